@@ -1,11 +1,48 @@
 ﻿#include <iostream>
 #include <vector>
+#include <string>
+#include <cstdint>
+#include <cstdio>
+#include <sys/stat.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <map>
+#include <tuple>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <random>
+#include <cfloat>
+#include <unordered_map>
+#include <numeric>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#ifdef __linux__
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 #include <glm/glm.hpp>
 #include <glm/gtc/constants.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/packing.hpp>
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
@@ -27,574 +64,5031 @@ int check_gl_err()
 	return err_no;
 }
 
-GLuint load_texture(const char* tex_file)
+// s as a quoted JSON string
+void write_json_string(FILE* f, const char* s)
 {
-	int img_width, img_height, img_channel;
-	auto img_data = stbi_load(tex_file, &img_width, &img_height, &img_channel, 4);
-	if (!img_data)
+	fputc('"', f);
+	for (; *s; s++)
 	{
-		printf("cannot load texture\n");
-		return false;
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
 	}
-	GLuint ret = 0;
-	glGenTextures(1, &ret);
-	glBindTexture(GL_TEXTURE_2D, ret);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, img_width, img_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, img_data);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	return ret;
+	fputc('"', f);
 }
 
-struct Model
+// flight recorder for chrome://tracing and ui.perfetto.dev, off until --trace or F2: each
+// thread appends to its own ring of CAPACITY events (single writer, no locks after the
+// thread's first event) and stop() writes the newest events of every thread as Chrome trace
+// JSON, then frees the rings. Names and details are not copied, they must outlive the trace
+// (string literals, asset paths)
+struct Tracer
 {
-	std::vector<vec3> vertices;
-	std::vector<vec3> normals;
-	std::vector<vec2> uvs;
-	std::vector<uint> indices;
-	GLuint texture = 0;
+	static const uint64_t CAPACITY = 1 << 14; // per thread, power of two
 
-	bool load(const char* obj_file, const char* tex_file)
+	struct Event
 	{
-		Assimp::Importer importer;
-		auto load_flags =
-			aiProcess_RemoveRedundantMaterials |
-			aiProcess_FlipUVs;
-		auto scene = importer.ReadFile(obj_file, load_flags);
-		if (!scene)
+		const char* name;
+		const char* detail;
+		double value;
+		uint64_t ns;
+		char phase; // B/E zone, C counter, i frame marker
+	};
+
+	// events and head belong to the owning thread while recording, stop() only reads or
+	// frees them once recording is off and busy has been seen cleared
+	struct Buffer
+	{
+		std::unique_ptr<Event[]> events; // allocated on the first event recorded
+		uint64_t head = 0;
+		std::atomic<bool> busy{ false }; // the owner is between its enabled check and the write
+		std::atomic<const char*> name{ nullptr };
+		int tid = 0;
+	};
+
+	std::atomic<bool> enabled{ false };
+	std::mutex mutex; // guards buffers
+	std::vector<std::unique_ptr<Buffer>> buffers;
+	const char* path = "trace.json";
+	bool dump_on_exit = false;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	void parse(int argc, char** argv)
+	{
+		for (auto i = 1; i + 1 < argc; i++)
 		{
-			printf("cannot open model: %s\n", importer.GetErrorString());
-			return false;
+			if (strcmp(argv[i], "--trace"))
+				continue;
+			path = argv[++i];
+			dump_on_exit = true;
+			enabled = true;
 		}
+	}
 
-		for (auto i = 0; i < scene->mNumMeshes; i++)
+	// buffers outlive their threads so finished loader jobs still show up
+	Buffer& local()
+	{
+		thread_local Buffer* buffer = nullptr;
+		if (!buffer)
 		{
-			auto src = scene->mMeshes[i];
-			for (auto j = 0; j < src->mNumVertices; j++)
-			{
-				vertices.push_back(*(vec3*)&src->mVertices[j]);
-				normals.push_back(src->mNormals ? *(vec3*)&src->mNormals[j] : vec3(0.f));
-				uvs.push_back(src->mTextureCoords[0] ? *(vec2*)&src->mTextureCoords[0][j] : vec2(0.f));
-			}
-			for (auto j = 0; j < src->mNumFaces; j++)
-			{
-				indices.push_back(src->mFaces[j].mIndices[0]);
-				indices.push_back(src->mFaces[j].mIndices[1]);
-				indices.push_back(src->mFaces[j].mIndices[2]);
-			}
+			std::lock_guard<std::mutex> lock(mutex);
+			buffers.emplace_back(new Buffer);
+			buffer = buffers.back().get();
+			buffer->tid = (int)buffers.size();
 		}
+		return *buffer;
+	}
 
-		if (tex_file)
+	void name_thread(const char* name) { local().name = name; }
+
+	void record(char phase, const char* name, const char* detail = nullptr, double value = 0.0)
+	{
+		if (!enabled.load(std::memory_order_relaxed))
+			return;
+		auto& b = local();
+		// both seq_cst, paired with stop(): either this sees recording off or stop() sees busy
+		b.busy.store(true);
+		if (enabled.load())
 		{
-			texture = load_texture(tex_file);
-			if (!texture)
-			{
-				printf("cannot load texture\n");
-				return false;
-			}
+			if (!b.events)
+				b.events.reset(new Event[CAPACITY]);
+			auto& e = b.events[b.head++ & (CAPACITY - 1)];
+			e.name = name;
+			e.detail = detail;
+			e.value = value;
+			e.ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+			e.phase = phase;
 		}
+		b.busy.store(false, std::memory_order_release);
+	}
 
-		return true;
+	void begin()
+	{
+		enabled = true;
+		printf("trace: recording, F2 writes %s\n", path);
 	}
 
-	void draw()
+	// stops recording and waits for events still being written, then writes the rings to
+	// file and frees them
+	bool stop(const char* file)
 	{
-		glBindTexture(GL_TEXTURE_2D, texture);
-		glBegin(GL_TRIANGLES);
-		for (auto i : indices)
+		enabled = false;
+		std::vector<Buffer*> threads;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (auto& b : buffers)
+				threads.push_back(b.get());
+		}
+		for (auto b : threads)
 		{
-			auto& uv = uvs[i];
-			glTexCoord2f(uv.x, uv.y);
-			auto& nor = normals[i];
-			glNormal3f(nor.x, nor.y, nor.z);
-			auto& v = vertices[i];
-			glVertex3f(v.x, v.y, v.z);
+			while (b->busy.load(std::memory_order_acquire))
+				std::this_thread::yield();
 		}
-		glEnd();
+		auto ok = write(file, threads);
+		for (auto b : threads)
+		{
+			b->events.reset();
+			b->head = 0;
+		}
+		return ok;
 	}
-}cow;
 
-GLuint create_shader(GLuint type, const std::string& source)
-{
-	auto ret = glCreateShader(type);
-	const char* sources[] = {
-		source.c_str()
-	};
-	int lengths[] = {
-		source.size()
-	};
-	glShaderSource(ret, 1, sources, lengths);
-	glCompileShader(ret);
-	int ok;
-	glGetShaderiv(ret, GL_COMPILE_STATUS, &ok);
-	if (ok == GL_FALSE)
+	bool write(const char* file, const std::vector<Buffer*>& threads)
 	{
-		int len;
-		glGetShaderiv(ret, GL_INFO_LOG_LENGTH, &len);
-		std::string str;
-		str.resize(len);
-		glGetShaderInfoLog(ret, str.size(), &len, (char*)str.data());
-		printf("%s\n", str.c_str());
-		assert(0);
+		auto f = fopen(file, "w");
+		if (!f)
+		{
+			printf("cannot write trace: %s\n", file);
+			return false;
+		}
+		fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+		fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"trains\"}}");
+		size_t count = 0;
+		for (auto b : threads)
+		{
+			if (auto name = b->name.load())
+			{
+				fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", b->tid);
+				write_json_string(f, name);
+				fprintf(f, "}}");
+			}
+			if (!b->events)
+				continue;
+			// zones whose begin was overwritten would close an enclosing zone
+			auto depth = 0;
+			for (auto i = b->head > CAPACITY ? b->head - CAPACITY : 0; i < b->head; i++)
+			{
+				auto& e = b->events[i & (CAPACITY - 1)];
+				if (e.phase == 'E')
+				{
+					if (depth == 0)
+						continue;
+					depth--;
+				}
+				else if (e.phase == 'B')
+					depth++;
+				fprintf(f, ",\n{\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%.3f", e.phase, b->tid, e.ns / 1e3);
+				if (e.name)
+				{
+					fprintf(f, ",\"name\":");
+					write_json_string(f, e.name);
+				}
+				if (e.phase == 'C')
+				{
+					fprintf(f, ",\"args\":{");
+					write_json_string(f, e.name);
+					fprintf(f, ":%.17g}", e.value);
+				}
+				else if (e.phase == 'i')
+					fprintf(f, ",\"s\":\"g\"");
+				else if (e.detail)
+				{
+					fprintf(f, ",\"args\":{\"detail\":");
+					write_json_string(f, e.detail);
+					fprintf(f, "}");
+				}
+				fprintf(f, "}");
+				count++;
+			}
+		}
+		fprintf(f, "\n]}\n");
+		fclose(f);
+		printf("trace: %zu events from %zu threads written to %s\n", count, threads.size(), file);
+		return true;
 	}
-	return ret;
-}
+}tracer;
 
-GLuint create_program(GLuint vertex_shader, GLuint fragment_shader)
+struct TraceZone
 {
-	auto ret = glCreateProgram();
-	glAttachShader(ret, vertex_shader);
-	glAttachShader(ret, fragment_shader);
-	glLinkProgram(ret);
-	int ok;
-	glGetProgramiv(ret, GL_LINK_STATUS, &ok);
-	if (ok == GL_FALSE)
-	{
-		int len;
-		glGetProgramiv(ret, GL_INFO_LOG_LENGTH, &len);
-		std::string str;
-		str.resize(len);
-		glGetProgramInfoLog(ret, str.size(), &len, (char*)str.data());
-		printf("%s\n", str.c_str());
-		assert(0);
-	}
-	return ret;
-}
+	TraceZone(const char* name, const char* detail = nullptr) { tracer.record('B', name, detail); }
+	~TraceZone() { tracer.record('E', nullptr); }
+};
 
-struct Camera
+// define NO_TRACE to compile the instrumentation out
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#ifndef NO_TRACE
+#define TRACE_ZONE(...) TraceZone TRACE_CONCAT(trace_zone_, __COUNTER__)(__VA_ARGS__)
+#define TRACE_BEGIN(name) tracer.record('B', name)
+#define TRACE_END() tracer.record('E', nullptr)
+#define TRACE_COUNTER(name, value) tracer.record('C', name, nullptr, (double)(value))
+#define TRACE_FRAME() tracer.record('i', "frame")
+#else
+#define TRACE_ZONE(...) ((void)0)
+#define TRACE_BEGIN(name) ((void)0)
+#define TRACE_END() ((void)0)
+#define TRACE_COUNTER(name, value) ((void)0)
+#define TRACE_FRAME() ((void)0)
+#endif
+
+// shadow copy of the GL state the frame sets; calls that wouldn't change it are dropped
+// before they reach the driver. All changes to this state go through here (ImGui's GL2
+// backend restores whatever it touches, so it's left alone). Bindings and values start
+// out unknown and the first call always goes through, texture binds apply to GL_TEXTURE_2D
+struct GLState
 {
-	vec3 coord = vec3(0.f, 1.f, 0.f);
-	float x_angle = 0.f;
-	float y_angle = 0.f;
-	vec3 forward_dir;
-	vec3 side_dir;
-	bool forward = false;
-	bool backward = false;
-	bool left = false;
-	bool right = false;
+	static const GLuint UNKNOWN = ~0U;
+	static const int TEXTURE_UNITS = 8;
 
-	mat4 update()
+	struct Stats
 	{
-		mat4 rot;
-		rot = rotate(mat4(1.f), radians(x_angle), vec3(0.f, 1.f, 0.f));
-		rot = rotate(rot,		radians(y_angle), vec3(1.f, 0.f, 0.f));
-		forward_dir = -rot[2];
-		side_dir = rot[0];
+		uint issued = 0;
+		uint redundant = 0;
+	};
 
-		if (forward)
-			coord += forward_dir * 0.1f;
-		if (backward)
-			coord -= forward_dir * 0.1f;
-		if (left)
-			coord -= side_dir * 0.1f;
-		if (right)
-			coord += side_dir * 0.1f;
+	std::vector<std::pair<GLenum, bool>> caps;
+	GLuint unit; // GL_TEXTURE0 + unit is active
+	GLuint textures[TEXTURE_UNITS];
+	GLuint program;
+	GLuint vao;
+	GLenum matrix;
+	GLenum depth_fn;
+	GLenum cull;
+	GLenum blend_src;
+	GLenum blend_dst;
+	int depth_write;
+	int color_write; // rgba bits
+	vec4 clear;
+	Stats stats; // current frame
 
-		return inverse(translate(mat4(1.f), coord) * rot);
+	GLState() { invalidate(); }
+
+	// forget everything, e.g. after a context change
+	void invalidate()
+	{
+		caps.clear();
+		unit = UNKNOWN;
+		for (auto& t : textures)
+			t = UNKNOWN;
+		program = vao = UNKNOWN;
+		matrix = depth_fn = cull = blend_src = blend_dst = UNKNOWN;
+		depth_write = color_write = -1;
+		clear = vec4(NAN); // never equal
 	}
-}camera;
 
-template<class T, size_t N>
-constexpr size_t size(T(&)[N]) { return N; }
+	void begin_frame()
+	{
+		stats = Stats();
+	}
 
-void prism(float depth, float width, float height, float y_off = 0.f)
-{
-	auto hf_width = width * 0.5f;
+	// counts the call, true if it has to be issued
+	bool changed(bool differs)
+	{
+		if (differs)
+			stats.issued++;
+		else
+			stats.redundant++;
+		return differs;
+	}
 
-	glNormal3f(0.f, 0.f, 1.f);
-	glTexCoord2f(0.f, 0.f);
-	glVertex3f(0.f, 0.f + y_off, 0.f);
-	glTexCoord2f(1.f, 0.f);
-	glVertex3f(width, 0.f + y_off, 0.f);
-	glTexCoord2f(0.f, 1.f);
-	glVertex3f(hf_width, height + y_off, 0.f);
+	void set(GLenum cap, bool on)
+	{
+		auto it = std::find_if(caps.begin(), caps.end(), [cap](const std::pair<GLenum, bool>& c) { return c.first == cap; });
+		if (!changed(it == caps.end() || it->second != on))
+			return;
+		if (it == caps.end())
+			caps.emplace_back(cap, on);
+		else
+			it->second = on;
+		if (on)
+			glEnable(cap);
+		else
+			glDisable(cap);
+	}
 
-	auto slop_normal1 = normalize(cross(vec3(0.f, 0.f, 1.f), vec3(hf_width, -height, 0.f)));
-	glNormal3f(slop_normal1.x, slop_normal1.y, slop_normal1.z);
-	glTexCoord2f(0.f, 0.f);
-	glVertex3f(hf_width, height + y_off, 0.f);
-	glTexCoord2f(0.f, 1.f);
-	glVertex3f(width, 0.f + y_off, 0.f);
-	glTexCoord2f(1.f, 0.f);
-	glVertex3f(hf_width, height + y_off, -depth);
-	glTexCoord2f(1.f, 0.f);
-	glVertex3f(hf_width, height + y_off, -depth);
-	glTexCoord2f(0.f, 1.f);
-	glVertex3f(width, 0.f + y_off, 0.f);
-	glTexCoord2f(1.f, 1.f);
-	glVertex3f(width, 0.f + y_off, -depth);
+	void enable(GLenum cap) { set(cap, true); }
+	void disable(GLenum cap) { set(cap, false); }
 
-	auto slop_normal2 = normalize(cross(vec3(0.f, 0.f, -1.f), vec3(-hf_width, -height, 0.f)));
-	glNormal3f(slop_normal2.x, slop_normal2.y, slop_normal2.z);
-	glTexCoord2f(0.f, 0.f);
-	glVertex3f(hf_width, height + y_off, -depth);
-	glTexCoord2f(0.f, 1.f);
-	glVertex3f(0.f, 0.f + y_off, -depth);
-	glTexCoord2f(1.f, 0.f);
-	glVertex3f(hf_width, height + y_off, 0.f);
-	glTexCoord2f(1.f, 0.f);
-	glVertex3f(hf_width, height + y_off, 0.f);
-	glTexCoord2f(0.f, 1.f);
-	glVertex3f(0.f, 0.f + y_off, -depth);
-	glTexCoord2f(1.f, 1.f);
-	glVertex3f(0.f, 0.f + y_off, 0.f);
-
-	glNormal3f(0.f, 0.f, -1.f);
-	glTexCoord2f(0.f, 0.f);
-	glVertex3f(0.f, 0.f + y_off, -depth);
-	glTexCoord2f(0.f, 1.f);
-	glVertex3f(hf_width, height + y_off, -depth);
-	glTexCoord2f(1.f, 0.f);
-	glVertex3f(width, 0.f + y_off, -depth);
-}
+	void clear_color(const vec4& c)
+	{
+		if (!changed(c != clear))
+			return;
+		clear = c;
+		glClearColor(c.r, c.g, c.b, c.a);
+	}
 
-auto move = 0; // stand, forward, backward
+	void matrix_mode(GLenum mode)
+	{
+		if (!changed(mode != matrix))
+			return;
+		matrix = mode;
+		glMatrixMode(mode);
+	}
 
-static GLFWkeyfun prev_keyfun = nullptr;
-void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
-{
-	if (prev_keyfun)
-		prev_keyfun(window, key, scancode, action, mods);
-	if (ImGui::GetIO().WantCaptureKeyboard)
-		return;
-	if (key == GLFW_KEY_W)
+	void active_texture(GLenum texture)
 	{
-		if (action == GLFW_PRESS)
-			camera.forward = true;
-		else if (action == GLFW_RELEASE)
-			camera.forward = false;
+		if (!changed(texture - GL_TEXTURE0 != unit))
+			return;
+		unit = texture - GL_TEXTURE0;
+		glActiveTexture(texture);
 	}
-	else if (key == GLFW_KEY_S)
+
+	void bind_texture(GLuint id)
 	{
-		if (action == GLFW_PRESS)
-			camera.backward = true;
-		else if (action == GLFW_RELEASE)
-			camera.backward = false;
+		if (unit >= TEXTURE_UNITS)
+		{
+			// active unit unknown or not tracked
+			changed(true);
+			glBindTexture(GL_TEXTURE_2D, id);
+			return;
+		}
+		if (!changed(id != textures[unit]))
+			return;
+		textures[unit] = id;
+		glBindTexture(GL_TEXTURE_2D, id);
 	}
-	else if (key == GLFW_KEY_A)
+
+	void use_program(GLuint id)
 	{
-		if (action == GLFW_PRESS)
-			camera.left = true;
-		else if (action == GLFW_RELEASE)
-			camera.left = false;
+		if (!changed(id != program))
+			return;
+		program = id;
+		glUseProgram(id);
 	}
-	else if (key == GLFW_KEY_D)
+
+	void bind_vertex_array(GLuint id)
 	{
-		if (action == GLFW_PRESS)
-			camera.right = true;
-		else if (action == GLFW_RELEASE)
-			camera.right = false;
+		if (!changed(id != vao))
+			return;
+		vao = id;
+		glBindVertexArray(id);
 	}
-	else if (key == GLFW_KEY_SPACE)
+
+	void depth_func(GLenum fn)
 	{
-		if (action == GLFW_PRESS && move == 0)
-			move = 1;
+		if (!changed(fn != depth_fn))
+			return;
+		depth_fn = fn;
+		glDepthFunc(fn);
 	}
-}
 
-bool dragging = false;
-double last_x = 0;
-double last_y = 0;
+	void depth_mask(GLboolean on)
+	{
+		if (!changed(on != depth_write))
+			return;
+		depth_write = on;
+		glDepthMask(on);
+	}
 
-static GLFWmousebuttonfun prev_mousebuttonfun = nullptr;
-void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
-{
-	if (prev_mousebuttonfun)
-		prev_mousebuttonfun(window, button, action, mods);
-	if (ImGui::GetIO().WantCaptureMouse)
-		return;
-	if (button == GLFW_MOUSE_BUTTON_LEFT)
+	void color_mask(GLboolean r, GLboolean g, GLboolean b, GLboolean a)
 	{
-		if (action == GLFW_PRESS)
+		auto bits = (r ? 1 : 0) | (g ? 2 : 0) | (b ? 4 : 0) | (a ? 8 : 0);
+		if (!changed(bits != color_write))
+			return;
+		color_write = bits;
+		glColorMask(r, g, b, a);
+	}
+
+	void cull_face(GLenum face)
+	{
+		if (!changed(face != cull))
+			return;
+		cull = face;
+		glCullFace(face);
+	}
+
+	void blend_func(GLenum src, GLenum dst)
+	{
+		if (!changed(src != blend_src || dst != blend_dst))
+			return;
+		blend_src = src;
+		blend_dst = dst;
+		glBlendFunc(src, dst);
+	}
+
+	// deleting a bound object reverts the binding to 0 and its name can be reused
+	void deleted_texture(GLuint id)
+	{
+		for (auto& t : textures)
 		{
-			glfwGetCursorPos(window, &last_x, &last_y);
-			dragging = true;
+			if (t == id)
+				t = 0;
 		}
-		else if (action == GLFW_RELEASE)
-			dragging = false;
 	}
-}
 
-static GLFWcursorposfun prev_cursorposfun = nullptr;
-void cursor_position_callback(GLFWwindow* window, double xpos, double ypos)
+	void deleted_vertex_array(GLuint id)
+	{
+		if (vao == id)
+			vao = 0;
+	}
+}gl_state;
+
+// decoded RGBA8 pixels, produced on a loader thread and uploaded on the GL thread
+struct Image
 {
-	if (prev_cursorposfun)
-		prev_cursorposfun(window, xpos, ypos);
-	if (ImGui::GetIO().WantCaptureMouse)
-		return;
-	if (dragging)
+	int width = 0;
+	int height = 0;
+	stbi_uc* pixels = nullptr;
+
+	Image() = default;
+	Image(const Image&) = delete;
+	Image& operator=(const Image&) = delete;
+	~Image()
 	{
-		camera.x_angle -= xpos - last_x;
-		camera.y_angle -= ypos - last_y;
-		last_x = xpos;
-		last_y = ypos;
+		if (pixels)
+			stbi_image_free(pixels);
+	}
+
+	bool decode(const char* tex_file)
+	{
+		TRACE_ZONE("decode image", tex_file);
+		int img_channel;
+		pixels = stbi_load(tex_file, &width, &height, &img_channel, 4);
+		return pixels != nullptr;
 	}
+};
+
+GLuint upload_texture(int width, int height, const void* pixels)
+{
+	TRACE_ZONE("upload texture");
+	GLuint ret = 0;
+	glGenTextures(1, &ret);
+	gl_state.bind_texture(ret);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+	gl_state.bind_texture(0);
+	return ret;
 }
 
-const auto GRIDX = 20U;
-const auto GRIDY = 40U;
-const auto GRIDS = 0.2f;
+// 1x1 white texture bound while the real one is still loading
+GLuint create_placeholder_texture()
+{
+	const uint8_t white[] = { 255, 255, 255, 255 };
+	return upload_texture(1, 1, white);
+}
 
-int main()
+struct Vertex
 {
-	if (!glfwInit())
-		return 0;
+	vec3 position;
+	vec3 normal;
+	vec2 uv;
+};
 
-	window = glfwCreateWindow(800, 600, "", nullptr, nullptr);
-	if (!window)
-		return 0;
+// opt-in (--compact) 16 byte layout decoded in the object vertex shader:
+// unorm16 position relative to the mesh AABB, snorm16 octahedral normal, half float uv
+struct CompactVertex
+{
+	uint16_t position[4]; // w is padding
+	int16_t normal[2];
+	uint32_t uv;
+};
 
-	glfwMakeContextCurrent(window);
-	glfwSwapInterval(1);
+// generic attribute slots used by the compact layout, 0 so it aliases gl_Vertex
+const GLuint ATTRIB_POSITION_Q = 0;
+const GLuint ATTRIB_NORMAL_OCT = 1;
+const GLuint ATTRIB_UV_H = 2;
+// instanced programs, a mat4 takes four slots; chosen to stay clear of the conventional
+// attributes the shaders read on drivers that alias them (gl_Normal 2, gl_MultiTexCoord0 8)
+const GLuint ATTRIB_INSTANCE_MAT = 4;
+const GLuint ATTRIB_INSTANCE_TINT = 3;
+const GLuint ATTRIB_INSTANCE_PHASE = 3; // wheels have no tint
 
-	if (glewInit() != GLEW_OK)
+bool compact_vertices = false;
+
+struct AABB
+{
+	vec3 min = vec3(FLT_MAX);
+	vec3 max = vec3(-FLT_MAX);
+
+	bool empty() const { return min.x > max.x; }
+	vec3 center() const { return (min + max) * 0.5f; }
+	vec3 extents() const { return (max - min) * 0.5f; }
+
+	void extend(const vec3& p)
 	{
-		printf("glew init failed\n");
-		return 0;
+		min = glm::min(min, p);
+		max = glm::max(max, p);
 	}
 
-	if (!cow.load("cow.obj", nullptr))
-		return 0;
+	void extend(const AABB& box)
+	{
+		if (box.empty())
+			return;
+		extend(box.min);
+		extend(box.max);
+	}
 
-	IMGUI_CHECKVERSION();
-	ImGui::CreateContext();
+	// box enclosing this one after transform m
+	AABB transformed(const mat4& m) const
+	{
+		if (empty())
+			return *this;
+		auto c = vec3(m * vec4(center(), 1.f));
+		auto r = mat3(m);
+		auto e = extents();
+		auto we = vec3(
+			abs(r[0][0]) * e.x + abs(r[1][0]) * e.y + abs(r[2][0]) * e.z,
+			abs(r[0][1]) * e.x + abs(r[1][1]) * e.y + abs(r[2][1]) * e.z,
+			abs(r[0][2]) * e.x + abs(r[1][2]) * e.y + abs(r[2][2]) * e.z);
+		AABB ret;
+		ret.min = c - we;
+		ret.max = c + we;
+		return ret;
+	}
+};
 
-	ImGui::StyleColorsDark();
+struct Mesh
+{
+	AABB bounds;
+	GLuint vao = 0;
+	GLuint vbo = 0;
+	GLuint ibo = 0;
+	GLsizei index_count = 0;
+	GLenum index_type = GL_UNSIGNED_INT;
 
-	ImGui_ImplGlfw_InitForOpenGL(window, true);
-	ImGui_ImplOpenGL2_Init();
+	void create(const Vertex* vertices, size_t vertex_count, const uint* indices, size_t count)
+	{
+		glGenVertexArrays(1, &vao);
+		gl_state.bind_vertex_array(vao);
 
-	prev_keyfun = glfwSetKeyCallback(window, key_callback);
-	prev_mousebuttonfun = glfwSetMouseButtonCallback(window, mouse_button_callback);
-	prev_cursorposfun = glfwSetCursorPosCallback(window, cursor_position_callback);
+		glGenBuffers(1, &vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferData(GL_ARRAY_BUFFER, vertex_count * sizeof(Vertex), vertices, GL_STATIC_DRAW);
+		glGenBuffers(1, &ibo);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, count * sizeof(uint), indices, GL_STATIC_DRAW);
+		index_count = count;
+		index_type = GL_UNSIGNED_INT;
 
-	auto grid_program = create_program(
-		create_shader(GL_VERTEX_SHADER, 
+		// fixed function arrays so the shaders keep reading gl_Vertex/gl_Normal/gl_MultiTexCoord0
+		glEnableClientState(GL_VERTEX_ARRAY);
+		glVertexPointer(3, GL_FLOAT, sizeof(Vertex), (void*)offsetof(Vertex, position));
+		glEnableClientState(GL_NORMAL_ARRAY);
+		glNormalPointer(GL_FLOAT, sizeof(Vertex), (void*)offsetof(Vertex, normal));
+		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+		glTexCoordPointer(2, GL_FLOAT, sizeof(Vertex), (void*)offsetof(Vertex, uv));
+
+		gl_state.bind_vertex_array(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+
+	// indices are GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+	void create_compact(const CompactVertex* vertices, size_t vertex_count, const void* indices, size_t count, GLenum type)
+	{
+		glGenVertexArrays(1, &vao);
+		gl_state.bind_vertex_array(vao);
+
+		glGenBuffers(1, &vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferData(GL_ARRAY_BUFFER, vertex_count * sizeof(CompactVertex), vertices, GL_STATIC_DRAW);
+		glGenBuffers(1, &ibo);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, count * (type == GL_UNSIGNED_SHORT ? 2 : 4), indices, GL_STATIC_DRAW);
+		index_count = count;
+		index_type = type;
+
+		glEnableVertexAttribArray(ATTRIB_POSITION_Q);
+		glVertexAttribPointer(ATTRIB_POSITION_Q, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(CompactVertex), (void*)offsetof(CompactVertex, position));
+		glEnableVertexAttribArray(ATTRIB_NORMAL_OCT);
+		glVertexAttribPointer(ATTRIB_NORMAL_OCT, 2, GL_SHORT, GL_TRUE, sizeof(CompactVertex), (void*)offsetof(CompactVertex, normal));
+		glEnableVertexAttribArray(ATTRIB_UV_H);
+		glVertexAttribPointer(ATTRIB_UV_H, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(CompactVertex), (void*)offsetof(CompactVertex, uv));
+
+		gl_state.bind_vertex_array(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+
+	void destroy()
+	{
+		glDeleteBuffers(1, &vbo);
+		glDeleteBuffers(1, &ibo);
+		glDeleteVertexArrays(1, &vao);
+		gl_state.deleted_vertex_array(vao);
+		vao = vbo = ibo = 0;
+		index_count = 0;
+	}
+};
+
+struct Instance
+{
+	mat4 transform;
+	vec4 tint = vec4(1.f);
+	float phase = 0.f; // rotation around the local z axis, radians
+};
+
+inline uint64_t align_up(uint64_t v, uint64_t a) { return (v + a - 1) / a * a; }
+
+// stream buffer for data rewritten every frame (uniform blocks, instance attributes):
+// FRAMES regions written front to back, one per frame, each guarded by a fence so the CPU
+// only waits when it gets FRAMES frames ahead of the GPU. With ARB_buffer_storage the
+// buffer stays persistently mapped and writes are plain memcpy, otherwise they go through
+// glBufferSubData into the same fenced regions. A frame that doesn't fit grows the buffer;
+// the old one is kept until the GPU is done with the draws that still reference it
+struct RingBuffer
+{
+	static const int FRAMES = 3;
+
+	struct Allocation
+	{
+		GLuint buffer;
+		GLintptr offset;
+	};
+
+	struct Retired
+	{
+		GLuint buffer;
+		GLsync fence;
+	};
+
+	struct Stats
+	{
+		size_t bytes = 0;
+		uint waits = 0; // frames that found their region still in use by the GPU
+	};
+
+	GLuint buffer = 0;
+	uint8_t* mapped = nullptr;
+	size_t region_size = 0;
+	int region = 0;
+	size_t head = 0; // within the current region
+	GLsync fences[FRAMES] = {};
+	std::vector<Retired> retired;
+	Stats stats;
+
+	void create(size_t size)
+	{
+		region_size = size;
+		region = 0;
+		head = 0;
+		auto total = (GLsizeiptr)(size * FRAMES);
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+		if (GLEW_ARB_buffer_storage)
+		{
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(GL_COPY_WRITE_BUFFER, total, nullptr, flags);
+			mapped = (uint8_t*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, total, flags);
+		}
+		else
+		{
+			glBufferData(GL_COPY_WRITE_BUFFER, total, nullptr, GL_DYNAMIC_DRAW);
+			mapped = nullptr;
+		}
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	}
+
+	// size per frame, a power of two keeps every region start aligned
+	void init(size_t size = 1 << 20) { create(size); }
+
+	void begin_frame()
+	{
+		for (size_t i = 0; i < retired.size();)
+		{
+			auto& r = retired[i];
+			if (r.fence && glClientWaitSync(r.fence, 0, 0) != GL_TIMEOUT_EXPIRED)
+			{
+				glDeleteSync(r.fence);
+				glDeleteBuffers(1, &r.buffer);
+				retired.erase(retired.begin() + i);
+			}
+			else
+				i++;
+		}
+
+		region = (region + 1) % FRAMES;
+		head = 0;
+		stats = Stats();
+		if (auto fence = fences[region])
+		{
+			auto result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+			if (result == GL_TIMEOUT_EXPIRED)
+			{
+				stats.waits++;
+				while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+					;
+			}
+			glDeleteSync(fence);
+			fences[region] = nullptr;
+		}
+	}
+
+	// after the last command reading this frame's region
+	void end_frame()
+	{
+		fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		for (auto& r : retired)
+		{
+			if (!r.fence)
+				r.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		}
+	}
+
+	void grow(size_t size)
+	{
+		auto new_size = region_size;
+		while (new_size < size)
+			new_size *= 2;
+		// the retired buffer's fence is set at the end of this frame, after all its uses
+		retired.push_back(Retired{ buffer, nullptr });
+		for (auto& f : fences)
+		{
+			if (f)
+				glDeleteSync(f);
+			f = nullptr;
+		}
+		create(new_size);
+		printf("ring buffer grown to %zu bytes per frame\n", new_size);
+	}
+
+	Allocation write(const void* data, size_t size, size_t align = 16)
+	{
+		auto offset = align_up(head, align);
+		if (offset + size > region_size)
+		{
+			grow(std::max(region_size * 2, (size_t)align_up(size, align)));
+			offset = 0;
+		}
+		head = offset + size;
+		stats.bytes += size;
+		auto at = region * region_size + offset;
+		if (mapped)
+			memcpy(mapped + at, data, size);
+		else
+		{
+			glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+			glBufferSubData(GL_COPY_WRITE_BUFFER, at, size, data);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		}
+		return Allocation{ buffer, (GLintptr)at };
+	}
+
+	void destroy()
+	{
+		for (auto& f : fences)
+		{
+			if (f)
+				glDeleteSync(f);
+			f = nullptr;
+		}
+		for (auto& r : retired)
+		{
+			if (r.fence)
+				glDeleteSync(r.fence);
+			glDeleteBuffers(1, &r.buffer);
+		}
+		retired.clear();
+		// deleting a mapped buffer unmaps it
+		glDeleteBuffers(1, &buffer);
+		buffer = 0;
+		mapped = nullptr;
+	}
+}ring;
+
+// per-instance attributes stored in their own buffer and fed with a divisor of 1
+struct InstanceBuffer
+{
+	GLuint vbo = 0;
+	GLsizei count = 0;
+	size_t capacity = 0; // instances vbo has storage for
+	GLuint vao = 0;
+	GLint transform_loc = -1;
+	GLint phase_loc = -1;
+	GLint tint_loc = -1;
+	GLuint source = 0; // buffer and offset the attributes currently point at
+	GLintptr source_offset = 0;
+
+	// adds the instance attributes to mesh's vertex array, transform_loc is a mat4 attribute
+	void attach(const Mesh& mesh, GLint transform, GLint phase, GLint tint = -1)
+	{
+		if (!vbo)
+			glGenBuffers(1, &vbo);
+		vao = mesh.vao;
+		transform_loc = transform;
+		phase_loc = phase;
+		tint_loc = tint;
+		point(vbo, 0);
+	}
+
+	void point(GLuint buffer, GLintptr offset)
+	{
+		auto at = [&](size_t member) { return (void*)(offset + member); };
+		gl_state.bind_vertex_array(vao);
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		for (auto i = 0; i < 4; i++)
+		{
+			glEnableVertexAttribArray(transform_loc + i);
+			glVertexAttribPointer(transform_loc + i, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), at(offsetof(Instance, transform) + sizeof(vec4) * i));
+			glVertexAttribDivisor(transform_loc + i, 1);
+		}
+		if (phase_loc >= 0)
+		{
+			glEnableVertexAttribArray(phase_loc);
+			glVertexAttribPointer(phase_loc, 1, GL_FLOAT, GL_FALSE, sizeof(Instance), at(offsetof(Instance, phase)));
+			glVertexAttribDivisor(phase_loc, 1);
+		}
+		if (tint_loc >= 0)
+		{
+			glEnableVertexAttribArray(tint_loc);
+			glVertexAttribPointer(tint_loc, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), at(offsetof(Instance, tint)));
+			glVertexAttribDivisor(tint_loc, 1);
+		}
+		gl_state.bind_vertex_array(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		source = buffer;
+		source_offset = offset;
+	}
+
+	// per-frame instances go through the ring buffer, the attributes follow the allocation
+	void stream(RingBuffer& ring, const std::vector<Instance>& instances)
+	{
+		count = (GLsizei)instances.size();
+		if (instances.empty())
+			return;
+		auto a = ring.write(instances.data(), instances.size() * sizeof(Instance));
+		if (a.buffer != source || a.offset != source_offset)
+			point(a.buffer, a.offset);
+	}
+
+	// storage for n instances, keeps the current one if it's big enough
+	void reserve(size_t n, GLenum usage = GL_STREAM_DRAW)
+	{
+		if (n <= capacity)
+			return;
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferData(GL_ARRAY_BUFFER, n * sizeof(Instance), nullptr, usage);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		capacity = n;
+	}
+
+	// overwrites the front of the storage, which is only reallocated when it has to grow
+	void update(const std::vector<Instance>& instances, GLenum usage = GL_STREAM_DRAW)
+	{
+		if (source != vbo || source_offset)
+			point(vbo, 0);
+		reserve(instances.size(), usage);
+		count = instances.size();
+		if (instances.empty())
+			return;
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, instances.size() * sizeof(Instance), instances.data());
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+
+	void destroy()
+	{
+		glDeleteBuffers(1, &vbo);
+		vbo = 0;
+		count = 0;
+		capacity = 0;
+	}
+};
+
+// read-only memory mapping of a whole file
+struct MappedFile
+{
+	const uint8_t* data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#else
+	int fd = -1;
+#endif
+
+	bool open(const char* path)
+	{
+#ifdef _WIN32
+		// shared for writing so a header can be patched while mapped (see update_cache_mtime)
+		file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER len;
+		GetFileSizeEx(file, &len);
+		size = (size_t)len.QuadPart;
+		mapping = size ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+		if (mapping)
+			data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+		fd = ::open(path, O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		fstat(fd, &st);
+		size = (size_t)st.st_size;
+		if (size)
+		{
+			auto p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED)
+				data = (const uint8_t*)p;
+		}
+#endif
+		if (!data)
+		{
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	void close()
+	{
+#ifdef _WIN32
+		if (data)
+			UnmapViewOfFile(data);
+		if (mapping)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+		mapping = nullptr;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (data)
+			munmap((void*)data, size);
+		if (fd >= 0)
+			::close(fd);
+		fd = -1;
+#endif
+		data = nullptr;
+		size = 0;
+	}
+
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile() { close(); }
+};
+
+uint64_t hash_bytes(const void* data, size_t size, uint64_t h = 14695981039346656037ULL)
+{
+	// FNV-1a
+	auto p = (const uint8_t*)data;
+	for (size_t i = 0; i < size; i++)
+	{
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+uint64_t hash_file(const char* path)
+{
+	MappedFile f;
+	if (!f.open(path))
+		return 0;
+	return hash_bytes(f.data, f.size);
+}
+
+// binary mesh cache, written next to the source file as <source>.mesh
+// layout: MeshCacheHeader | pad | Vertex[vertex_count] | pad | uint[index_count]
+const uint32_t MESH_CACHE_MAGIC = 0x4853454d; // "MESH"
+const uint32_t MESH_CACHE_VERSION = 3;
+const uint64_t MESH_CACHE_ALIGN = 64;
+
+struct MeshCacheHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t source_mtime;
+	uint64_t source_size;
+	uint64_t source_hash;
+	uint32_t vertex_stride;
+	uint32_t vertex_count;
+	uint32_t index_count;
+	uint32_t reserved;
+	uint64_t vertex_offset;
+	uint64_t index_offset;
+	float bounds_min[3];
+	float bounds_max[3];
+};
+
+// CPU side of a model, either owned vectors from an import or a view into the mapped cache
+struct MeshData
+{
+	std::vector<Vertex> vertices;
+	std::vector<uint> indices;
+	MappedFile cache;
+	const Vertex* vertex_data = nullptr;
+	size_t vertex_count = 0;
+	const uint* index_data = nullptr;
+	size_t index_count = 0;
+	AABB bounds;
+
+	// filled by encode_compact() when --compact is on
+	std::vector<CompactVertex> compact_vertices;
+	std::vector<uint16_t> indices16;
+};
+
+vec2 encode_octahedral(vec3 n)
+{
+	auto l1 = abs(n.x) + abs(n.y) + abs(n.z);
+	if (l1 == 0.f)
+		return vec2(0.f);
+	n /= l1;
+	if (n.z >= 0.f)
+		return vec2(n.x, n.y);
+	return vec2(
+		(1.f - abs(n.y)) * (n.x >= 0.f ? 1.f : -1.f),
+		(1.f - abs(n.x)) * (n.y >= 0.f ? 1.f : -1.f));
+}
+
+void encode_compact(MeshData& data)
+{
+	auto range = data.bounds.max - data.bounds.min;
+	auto inv_range = vec3(
+		range.x > 0.f ? 1.f / range.x : 0.f,
+		range.y > 0.f ? 1.f / range.y : 0.f,
+		range.z > 0.f ? 1.f / range.z : 0.f);
+	data.compact_vertices.resize(data.vertex_count);
+	for (size_t i = 0; i < data.vertex_count; i++)
+	{
+		auto& src = data.vertex_data[i];
+		auto& dst = data.compact_vertices[i];
+		auto q = clamp((src.position - data.bounds.min) * inv_range, 0.f, 1.f) * 65535.f + 0.5f;
+		dst.position[0] = (uint16_t)q.x;
+		dst.position[1] = (uint16_t)q.y;
+		dst.position[2] = (uint16_t)q.z;
+		dst.position[3] = 0;
+		auto e = round(clamp(encode_octahedral(src.normal), -1.f, 1.f) * 32767.f);
+		dst.normal[0] = (int16_t)e.x;
+		dst.normal[1] = (int16_t)e.y;
+		dst.uv = packHalf2x16(src.uv);
+	}
+	if (data.vertex_count <= 0x10000)
+	{
+		data.indices16.resize(data.index_count);
+		for (size_t i = 0; i < data.index_count; i++)
+			data.indices16[i] = (uint16_t)data.index_data[i];
+	}
+}
+
+// load time index/vertex optimization, run once on import before the result is cached
+
+const uint VERTEX_CACHE_SIZE = 16;
+
+// average cache miss ratio: transformed vertices per triangle with a FIFO post-transform cache
+float simulate_acmr(const std::vector<uint>& indices, size_t vertex_count, uint cache_size = VERTEX_CACHE_SIZE)
+{
+	if (indices.empty())
+		return 0.f;
+	std::vector<uint> stamp(vertex_count, 0);
+	uint time = cache_size + 1;
+	size_t misses = 0;
+	for (auto v : indices)
+	{
+		if (time - stamp[v] > cache_size)
+		{
+			stamp[v] = time++;
+			misses++;
+		}
+	}
+	return (float)misses / (indices.size() / 3);
+}
+
+struct VertexHash
+{
+	size_t operator()(const Vertex& v) const { return (size_t)hash_bytes(&v, sizeof(v)); }
+};
+
+struct VertexEqual
+{
+	bool operator()(const Vertex& a, const Vertex& b) const { return memcmp(&a, &b, sizeof(Vertex)) == 0; }
+};
+
+// merges bitwise identical vertices, OBJ import emits one vertex per face corner
+void deduplicate_vertices(std::vector<Vertex>& vertices, std::vector<uint>& indices)
+{
+	std::unordered_map<Vertex, uint, VertexHash, VertexEqual> unique;
+	unique.reserve(vertices.size());
+	std::vector<uint> remap(vertices.size());
+	std::vector<Vertex> result;
+	result.reserve(vertices.size());
+	for (size_t i = 0; i < vertices.size(); i++)
+	{
+		auto it = unique.emplace(vertices[i], (uint)result.size());
+		if (it.second)
+			result.push_back(vertices[i]);
+		remap[i] = it.first->second;
+	}
+	for (auto& i : indices)
+		i = remap[i];
+	vertices.swap(result);
+}
+
+// Tipsify (Sander, Nehab, Barczak 2007); clusters receives the first triangle of every
+// run that started from a dead end, those are the boundaries optimize_overdraw may move
+void optimize_vertex_cache(std::vector<uint>& indices, size_t vertex_count, std::vector<uint>& clusters, uint cache_size = VERTEX_CACHE_SIZE)
+{
+	auto tri_count = indices.size() / 3;
+	std::vector<uint> live(vertex_count, 0);
+	for (auto v : indices)
+		live[v]++;
+	std::vector<uint> offsets(vertex_count + 1, 0);
+	std::partial_sum(live.begin(), live.end(), offsets.begin() + 1);
+	std::vector<uint> adjacency(indices.size());
+	{
+		auto fill = offsets;
+		for (size_t t = 0; t < tri_count; t++)
+			for (auto k = 0; k < 3; k++)
+				adjacency[fill[indices[t * 3 + k]]++] = (uint)t;
+	}
+
+	std::vector<uint> stamp(vertex_count, 0);
+	std::vector<bool> emitted(tri_count, false);
+	std::vector<uint> dead_end;
+	std::vector<uint> candidates;
+	std::vector<uint> result;
+	result.reserve(indices.size());
+	clusters.clear();
+
+	uint time = cache_size + 1;
+	size_t cursor = 0;
+	auto f = vertex_count ? 0 : -1;
+	auto new_cluster = true;
+	while (f >= 0)
+	{
+		candidates.clear();
+		for (auto a = offsets[f]; a < offsets[f + 1]; a++)
+		{
+			auto t = adjacency[a];
+			if (emitted[t])
+				continue;
+			if (new_cluster)
+			{
+				clusters.push_back((uint)result.size() / 3);
+				new_cluster = false;
+			}
+			for (auto k = 0; k < 3; k++)
+			{
+				auto v = indices[t * 3 + k];
+				result.push_back(v);
+				dead_end.push_back(v);
+				candidates.push_back(v);
+				live[v]--;
+				if (time - stamp[v] > cache_size)
+					stamp[v] = time++;
+			}
+			emitted[t] = true;
+		}
+
+		// next fanning vertex: the candidate that stays in cache the longest, otherwise a dead end
+		auto best = -1;
+		auto priority = -1;
+		for (auto v : candidates)
+		{
+			if (!live[v])
+				continue;
+			auto p = 0;
+			if (time - stamp[v] + 2 * live[v] <= cache_size)
+				p = time - stamp[v];
+			if (p > priority)
+			{
+				priority = p;
+				best = v;
+			}
+		}
+		if (best < 0)
+		{
+			new_cluster = true;
+			while (!dead_end.empty() && best < 0)
+			{
+				auto d = dead_end.back();
+				dead_end.pop_back();
+				if (live[d])
+					best = d;
+			}
+			while (best < 0 && cursor < vertex_count)
+			{
+				if (live[cursor])
+					best = (int)cursor;
+				cursor++;
+			}
+		}
+		f = best;
+	}
+	indices.swap(result);
+}
+
+// sorts clusters so outward facing ones on the hull are drawn first, which
+// lets early-Z reject more of the rest (Nehab et al. linear-speed overdraw ordering)
+void optimize_overdraw(std::vector<uint>& indices, const std::vector<Vertex>& vertices, const std::vector<uint>& clusters)
+{
+	auto tri_count = indices.size() / 3;
+	if (clusters.size() < 2)
+		return;
+
+	vec3 mesh_center(0.f);
+	auto mesh_area = 0.f;
+	std::vector<vec3> cluster_center(clusters.size(), vec3(0.f));
+	std::vector<vec3> cluster_normal(clusters.size(), vec3(0.f));
+	for (size_t c = 0; c < clusters.size(); c++)
+	{
+		auto end = c + 1 < clusters.size() ? clusters[c + 1] : tri_count;
+		auto area_sum = 0.f;
+		for (auto t = clusters[c]; t < end; t++)
+		{
+			auto& p0 = vertices[indices[t * 3 + 0]].position;
+			auto& p1 = vertices[indices[t * 3 + 1]].position;
+			auto& p2 = vertices[indices[t * 3 + 2]].position;
+			auto n = cross(p1 - p0, p2 - p0);
+			auto area = length(n);
+			cluster_center[c] += (p0 + p1 + p2) / 3.f * area;
+			cluster_normal[c] += n;
+			area_sum += area;
+		}
+		mesh_center += cluster_center[c];
+		mesh_area += area_sum;
+		if (area_sum > 0.f)
+			cluster_center[c] /= area_sum;
+	}
+	if (mesh_area > 0.f)
+		mesh_center /= mesh_area;
+
+	std::vector<float> sort_key(clusters.size());
+	for (size_t c = 0; c < clusters.size(); c++)
+	{
+		auto len = length(cluster_normal[c]);
+		auto n = len > 0.f ? cluster_normal[c] / len : vec3(0.f);
+		sort_key[c] = dot(cluster_center[c] - mesh_center, n);
+	}
+	std::vector<uint> order(clusters.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&](uint a, uint b) { return sort_key[a] > sort_key[b]; });
+
+	std::vector<uint> result;
+	result.reserve(indices.size());
+	for (auto c : order)
+	{
+		auto end = c + 1 < clusters.size() ? clusters[c + 1] : tri_count;
+		result.insert(result.end(), indices.begin() + clusters[c] * 3, indices.begin() + end * 3);
+	}
+	indices.swap(result);
+}
+
+// renumbers vertices in first use order so vertex fetch walks memory linearly
+void optimize_vertex_fetch(std::vector<Vertex>& vertices, std::vector<uint>& indices)
+{
+	const auto unused = ~0U;
+	std::vector<uint> remap(vertices.size(), unused);
+	std::vector<Vertex> result;
+	result.reserve(vertices.size());
+	for (auto& i : indices)
+	{
+		if (remap[i] == unused)
+		{
+			remap[i] = (uint)result.size();
+			result.push_back(vertices[i]);
+		}
+		i = remap[i];
+	}
+	vertices.swap(result);
+}
+
+void optimize_mesh(const char* name, std::vector<Vertex>& vertices, std::vector<uint>& indices)
+{
+	TRACE_ZONE("optimize mesh", name);
+	auto vertex_count = vertices.size();
+	auto acmr_before = simulate_acmr(indices, vertices.size());
+	deduplicate_vertices(vertices, indices);
+	std::vector<uint> clusters;
+	optimize_vertex_cache(indices, vertices.size(), clusters);
+	optimize_overdraw(indices, vertices, clusters);
+	optimize_vertex_fetch(vertices, indices);
+	printf("%s: %zu -> %zu vertices, ACMR %.3f -> %.3f\n",
+		name, vertex_count, vertices.size(), acmr_before, simulate_acmr(indices, vertices.size()));
+}
+
+struct Model
+{
+	GLuint texture = 0;
+	Mesh mesh;
+
+	static bool import(const char* obj_file, MeshData& data)
+	{
+		TRACE_ZONE("import mesh", obj_file);
+		Assimp::Importer importer;
+		auto load_flags =
+			aiProcess_RemoveRedundantMaterials |
+			aiProcess_FlipUVs |
+			aiProcess_GenBoundingBoxes;
+		auto scene = importer.ReadFile(obj_file, load_flags);
+		if (!scene)
+		{
+			printf("cannot open model: %s\n", importer.GetErrorString());
+			return false;
+		}
+
+		auto& vertices = data.vertices;
+		auto& indices = data.indices;
+		for (auto i = 0; i < scene->mNumMeshes; i++)
+		{
+			auto src = scene->mMeshes[i];
+			data.bounds.extend(*(vec3*)&src->mAABB.mMin);
+			data.bounds.extend(*(vec3*)&src->mAABB.mMax);
+			auto base = (uint)vertices.size();
+			vertices.reserve(vertices.size() + src->mNumVertices);
+			for (auto j = 0; j < src->mNumVertices; j++)
+			{
+				Vertex v;
+				v.position = *(vec3*)&src->mVertices[j];
+				v.normal = src->mNormals ? *(vec3*)&src->mNormals[j] : vec3(0.f);
+				v.uv = src->mTextureCoords[0] ? *(vec2*)&src->mTextureCoords[0][j] : vec2(0.f);
+				vertices.push_back(v);
+			}
+			indices.reserve(indices.size() + src->mNumFaces * 3);
+			for (auto j = 0; j < src->mNumFaces; j++)
+			{
+				indices.push_back(base + src->mFaces[j].mIndices[0]);
+				indices.push_back(base + src->mFaces[j].mIndices[1]);
+				indices.push_back(base + src->mFaces[j].mIndices[2]);
+			}
+		}
+		return true;
+	}
+
+	// fills header with the identity of the source file, returns false if it doesn't exist
+	static bool stat_source(const char* obj_file, MeshCacheHeader& header)
+	{
+		struct stat st;
+		if (stat(obj_file, &st) != 0)
+			return false;
+		header.source_mtime = (uint64_t)st.st_mtime;
+		header.source_size = (uint64_t)st.st_size;
+		return true;
+	}
+
+	// patches the header field in place, the rest of the cache is unchanged; a failed or torn
+	// write only means the hash is checked again next time
+	static void update_cache_mtime(const std::string& cache_file, uint64_t mtime)
+	{
+		auto fp = fopen(cache_file.c_str(), "r+b");
+		if (!fp)
+			return;
+		if (fseek(fp, offsetof(MeshCacheHeader, source_mtime), SEEK_SET) != 0 || fwrite(&mtime, sizeof(mtime), 1, fp) != 1)
+			printf("cannot update mesh cache: %s\n", cache_file.c_str());
+		fclose(fp);
+	}
+
+	static bool load_cache(const std::string& cache_file, const MeshCacheHeader& source, const char* obj_file, MeshData& data)
+	{
+		TRACE_ZONE("load mesh cache", obj_file);
+		auto& f = data.cache;
+		if (!f.open(cache_file.c_str()))
+			return false;
+		if (f.size < sizeof(MeshCacheHeader))
+		{
+			f.close();
+			return false;
+		}
+		auto& header = *(const MeshCacheHeader*)f.data;
+		auto valid = header.magic == MESH_CACHE_MAGIC &&
+			header.version == MESH_CACHE_VERSION &&
+			header.vertex_stride == sizeof(Vertex) &&
+			header.vertex_offset + (uint64_t)header.vertex_count * sizeof(Vertex) <= f.size &&
+			header.index_offset + (uint64_t)header.index_count * sizeof(uint) <= f.size &&
+			header.source_size == source.source_size;
+		// timestamps change on checkout/copy, so fall back to the content hash before giving up,
+		// and store the new timestamp when it matches so the next launch doesn't hash again
+		if (valid && header.source_mtime != source.source_mtime)
+		{
+			valid = header.source_hash == hash_file(obj_file);
+			if (valid)
+				update_cache_mtime(cache_file, source.source_mtime);
+		}
+		if (!valid)
+		{
+			f.close();
+			return false;
+		}
+
+		data.vertex_data = (const Vertex*)(f.data + header.vertex_offset);
+		data.vertex_count = header.vertex_count;
+		data.index_data = (const uint*)(f.data + header.index_offset);
+		data.index_count = header.index_count;
+		data.bounds.min = vec3(header.bounds_min[0], header.bounds_min[1], header.bounds_min[2]);
+		data.bounds.max = vec3(header.bounds_max[0], header.bounds_max[1], header.bounds_max[2]);
+		return true;
+	}
+
+	static bool save_cache(const std::string& cache_file, MeshCacheHeader header, const char* obj_file, const MeshData& data)
+	{
+		auto& vertices = data.vertices;
+		auto& indices = data.indices;
+		header.magic = MESH_CACHE_MAGIC;
+		header.version = MESH_CACHE_VERSION;
+		header.source_hash = hash_file(obj_file);
+		header.vertex_stride = sizeof(Vertex);
+		header.vertex_count = (uint32_t)vertices.size();
+		header.index_count = (uint32_t)indices.size();
+		header.reserved = 0;
+		header.vertex_offset = align_up(sizeof(MeshCacheHeader), MESH_CACHE_ALIGN);
+		header.index_offset = align_up(header.vertex_offset + vertices.size() * sizeof(Vertex), MESH_CACHE_ALIGN);
+		for (auto i = 0; i < 3; i++)
+		{
+			header.bounds_min[i] = data.bounds.min[i];
+			header.bounds_max[i] = data.bounds.max[i];
+		}
+
+		// write to a temp file first so a crash never leaves a truncated cache behind
+		auto tmp_file = cache_file + ".tmp";
+		auto fp = fopen(tmp_file.c_str(), "wb");
+		if (!fp)
+			return false;
+		static const uint8_t zeros[MESH_CACHE_ALIGN] = {};
+		auto ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+		ok = ok && fwrite(zeros, 1, header.vertex_offset - sizeof(header), fp) == header.vertex_offset - sizeof(header);
+		ok = ok && fwrite(vertices.data(), sizeof(Vertex), vertices.size(), fp) == vertices.size();
+		auto pad = header.index_offset - (header.vertex_offset + vertices.size() * sizeof(Vertex));
+		ok = ok && fwrite(zeros, 1, pad, fp) == pad;
+		ok = ok && fwrite(indices.data(), sizeof(uint), indices.size(), fp) == indices.size();
+		fclose(fp);
+		remove(cache_file.c_str());
+		if (!ok || rename(tmp_file.c_str(), cache_file.c_str()) != 0)
+		{
+			remove(tmp_file.c_str());
+			printf("cannot write mesh cache: %s\n", cache_file.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	// everything up to the GPU upload, safe to run on a loader thread
+	static bool load_data(const char* obj_file, MeshData& data)
+	{
+		MeshCacheHeader source = {};
+		auto cache_file = std::string(obj_file) + ".mesh";
+		auto has_source = stat_source(obj_file, source);
+		if (has_source && load_cache(cache_file, source, obj_file, data))
+			return true;
+
+		if (!import(obj_file, data))
+			return false;
+		optimize_mesh(obj_file, data.vertices, data.indices);
+		save_cache(cache_file, source, obj_file, data);
+		data.vertex_data = data.vertices.data();
+		data.vertex_count = data.vertices.size();
+		data.index_data = data.indices.data();
+		data.index_count = data.indices.size();
+		return true;
+	}
+
+	// load_data plus the optional compact encoding, still off the GL thread
+	static bool prepare(const char* obj_file, MeshData& data)
+	{
+		TRACE_ZONE("prepare mesh", obj_file);
+		if (!load_data(obj_file, data))
+			return false;
+		if (compact_vertices)
+			encode_compact(data);
+		return true;
+	}
+
+	void upload(const MeshData& data)
+	{
+		TRACE_ZONE("upload mesh");
+		if (!data.compact_vertices.empty())
+		{
+			if (!data.indices16.empty())
+				mesh.create_compact(data.compact_vertices.data(), data.compact_vertices.size(), data.indices16.data(), data.indices16.size(), GL_UNSIGNED_SHORT);
+			else
+				mesh.create_compact(data.compact_vertices.data(), data.compact_vertices.size(), data.index_data, data.index_count, GL_UNSIGNED_INT);
+		}
+		else
+			mesh.create(data.vertex_data, data.vertex_count, data.index_data, data.index_count);
+		mesh.bounds = data.bounds;
+	}
+}cow;
+
+// event-driven redraw for the windowed loop: the main thread publishes snapshots while the
+// scene animates, the camera moves or something marked the frame dirty (input callbacks,
+// asset completions, any other window event). After the last change SETTLE_FRAMES more are
+// published so the latent occlusion/pre-pass query results and ImGui layout catch up, then
+// the main thread blocks in wait(); the render thread gets nothing new to draw and the last
+// presented frame stays on screen
+struct Redraw
+{
+	static const int SETTLE_FRAMES = 4;
+
+	bool enabled = true;
+	double timeout = 0.5; // seconds between wake ups while idle
+	std::atomic<bool> dirty{ true };
+	int settle = SETTLE_FRAMES;
+
+	void parse(int argc, char** argv)
+	{
+		for (auto i = 1; i + 1 < argc; i++)
+		{
+			if (!strcmp(argv[i], "--idle"))
+				enabled = strcmp(argv[++i], "off") != 0;
+		}
+	}
+
+	// main thread, from the input callbacks
+	void mark() { dirty = true; }
+
+	// any thread, also wakes the main thread blocked in wait()
+	void wake()
+	{
+		dirty = true;
+		if (window)
+			glfwPostEmptyEvent();
+	}
+
+	// whether the next frame has to be rendered
+	bool needed(bool animating)
+	{
+		if (!enabled || animating || dirty.exchange(false))
+		{
+			settle = SETTLE_FRAMES;
+			return true;
+		}
+		if (settle > 0)
+		{
+			settle--;
+			return true;
+		}
+		return false;
+	}
+
+	// returning before the timeout means some event arrived, e.g. a resize, an expose or
+	// input only ImGui listens to, all of which need a new frame
+	void wait()
+	{
+		TRACE_ZONE("idle");
+		auto start = glfwGetTime();
+		glfwWaitEventsTimeout(timeout);
+		if (glfwGetTime() - start < timeout)
+			dirty = true;
+	}
+}redraw;
+
+// worker threads do file I/O, parsing and decoding; GL objects are only
+// created from the completion queue drained by pump() on the GL thread
+struct AssetLoader
+{
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> jobs;
+	std::vector<std::function<void()>> completions;
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::atomic<int> pending{ 0 };
+	bool quit = false;
+
+	void start(unsigned count = 0)
+	{
+		if (count == 0)
+			count = std::max(1U, std::max(1U, std::thread::hardware_concurrency()) - 1);
+		for (auto i = 0U; i < count; i++)
+		{
+			workers.emplace_back([this]() {
+				tracer.name_thread("asset loader");
+				while (true)
+				{
+					std::function<void()> job;
+					{
+						std::unique_lock<std::mutex> lock(mutex);
+						cv.wait(lock, [this]() { return quit || !jobs.empty(); });
+						if (quit && jobs.empty())
+							return;
+						job = std::move(jobs.front());
+						jobs.pop_front();
+					}
+					job();
+				}
+			});
+		}
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		cv.notify_all();
+		for (auto& t : workers)
+			t.join();
+		workers.clear();
+	}
+
+	// job runs on a worker, its result is handed to the GL thread through complete()
+	void submit(std::function<void()> job)
+	{
+		pending++;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			jobs.push_back(std::move(job));
+		}
+		cv.notify_one();
+	}
+
+	void complete(std::function<void()> fn)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			completions.push_back(std::move(fn));
+		}
+		redraw.wake();
+	}
+
+	// call once per frame on the GL thread
+	void pump()
+	{
+		std::vector<std::function<void()>> ready;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			ready.swap(completions);
+		}
+		for (auto& fn : ready)
+		{
+			fn();
+			pending--;
+		}
+	}
+
+	bool idle() const { return pending == 0; }
+
+	void load_texture(GLuint& target, const char* tex_file)
+	{
+		submit([this, &target, tex_file]() {
+			TRACE_ZONE("load texture", tex_file);
+			auto img = std::make_shared<Image>();
+			if (!img->decode(tex_file))
+				printf("cannot load texture: %s\n", tex_file);
+			complete([&target, img, tex_file]() {
+				TRACE_ZONE("finish texture", tex_file);
+				if (img->pixels)
+					target = upload_texture(img->width, img->height, img->pixels);
+			});
+		});
+	}
+
+	void load_model(Model& model, const char* obj_file, const char* tex_file)
+	{
+		submit([this, &model, obj_file]() {
+			TRACE_ZONE("load model", obj_file);
+			auto data = std::make_shared<MeshData>();
+			auto ok = Model::prepare(obj_file, *data);
+			complete([&model, data, ok, obj_file]() {
+				TRACE_ZONE("finish model", obj_file);
+				if (ok)
+					model.upload(*data);
+			});
+		});
+		if (tex_file)
+			load_texture(model.texture, tex_file);
+	}
+}loader;
+
+// fork-join pool for the per-frame work; run() splits the work into chunks picked up by the
+// workers and the calling thread, and returns when all of them are done. Chunks write only
+// their own outputs, which the caller merges in chunk order so results are deterministic
+struct FramePool
+{
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::condition_variable done_cv;
+	std::function<void(int)> task;
+	int chunks = 0;
+	std::atomic<int> next{ 0 };
+	int remaining = 0;
+	int active = 0;
+	uint64_t generation = 0;
+	bool quit = false;
+
+	void start(unsigned count = 0)
+	{
+		if (count == 0)
+			count = std::max(1U, std::thread::hardware_concurrency()) - 1;
+		for (auto i = 0U; i < count; i++)
+		{
+			workers.emplace_back([this]() {
+				tracer.name_thread("frame pool");
+				uint64_t seen = 0;
+				while (true)
+				{
+					{
+						std::unique_lock<std::mutex> lock(mutex);
+						cv.wait(lock, [&]() { return quit || generation != seen; });
+						if (quit)
+							return;
+						seen = generation;
+						active++;
+					}
+					work();
+					std::lock_guard<std::mutex> lock(mutex);
+					if (--active == 0 && remaining == 0)
+						done_cv.notify_all();
+				}
+			});
+		}
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		cv.notify_all();
+		for (auto& t : workers)
+			t.join();
+		workers.clear();
+	}
+
+	int size() const { return (int)workers.size() + 1; }
+
+	// [begin, end) of chunk i when n items are split into count chunks
+	static std::pair<size_t, size_t> range(size_t n, int i, int count) { return { n * i / count, n * (i + 1) / count }; }
+
+	void work()
+	{
+		for (int i; (i = next++) < chunks;)
+		{
+			{
+				TRACE_ZONE("pool chunk");
+				task(i);
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			remaining--;
+		}
+	}
+
+	void run(int count, std::function<void(int)> fn)
+	{
+		if (workers.empty() || count <= 1)
+		{
+			for (auto i = 0; i < count; i++)
+				fn(i);
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			task = std::move(fn);
+			chunks = count;
+			remaining = count;
+			next = 0;
+			generation++;
+		}
+		cv.notify_all();
+		work();
+		std::unique_lock<std::mutex> lock(mutex);
+		done_cv.wait(lock, [this]() { return remaining == 0 && active == 0; });
+	}
+}pool;
+
+// frame profiler: nested named sections timed on the CPU and, with ARB_timer_query, on the
+// GPU through GL_TIMESTAMP queries (timestamps don't nest-conflict with GL_TIME_ELAPSED
+// like the bench's frame query). Each frame records into one of LATENCY slots and is
+// resolved when the slot comes around again, by then the GPU is normally done with it.
+// Sections with the same name and depth are summed per frame
+struct Profiler
+{
+	static const int LATENCY = 4;
+	static const int HISTORY = 240;
+
+	struct Sample
+	{
+		int section;
+		double cpu_begin;
+		double cpu_end;
+		GLuint gpu_begin;
+		GLuint gpu_end;
+		uint draws;
+	};
+
+	struct Frame
+	{
+		std::vector<Sample> samples;
+		std::vector<GLuint> queries;
+		size_t used = 0;
+		double cpu_begin = 0.0;
+		double cpu_end = 0.0;
+		GLuint gpu_begin = 0;
+		GLuint gpu_end = 0;
+		bool pending = false;
+	};
+
+	struct Section
+	{
+		const char* name;
+		int depth;
+		double cpu_ms;
+		double gpu_ms;
+		uint draws;
+	};
+
+	// what the profiler window shows, a plain copy that's handed to the thread running the UI
+	struct Summary
+	{
+		bool gpu = false;
+		std::vector<Section> sections; // latest resolved frame, in first-seen order
+		float cpu_history[HISTORY] = {};
+		float gpu_history[HISTORY] = {};
+		int history_count = 0;
+		int skipped = 0; // frames dropped because their GPU results weren't in yet
+
+		// p in [0, 1] over the recorded history
+		float percentile(const float* history, float p) const
+		{
+			auto n = std::min(history_count, HISTORY);
+			if (!n)
+				return 0.f;
+			std::vector<float> v(history, history + n);
+			auto k = std::min(n - 1, (int)(p * n));
+			std::nth_element(v.begin(), v.begin() + k, v.end());
+			return v[k];
+		}
+
+		// contents of the profiler window, the caller owns Begin/End
+		void draw_ui() const
+		{
+			auto n = std::min(history_count, HISTORY);
+			auto offset = history_count > HISTORY ? history_count % HISTORY : 0;
+			ImGui::PlotLines("cpu ms", cpu_history, n, offset, nullptr, 0.f, 33.f, ImVec2(0, 60));
+			if (gpu)
+				ImGui::PlotLines("gpu ms", gpu_history, n, offset, nullptr, 0.f, 33.f, ImVec2(0, 60));
+			for (auto h : { cpu_history, gpu_history })
+			{
+				if (h == gpu_history && !gpu)
+					continue;
+				ImGui::Text("%s  p50 %.2f  p95 %.2f  p99 %.2f ms", h == cpu_history ? "cpu" : "gpu",
+					percentile(h, 0.5f), percentile(h, 0.95f), percentile(h, 0.99f));
+			}
+			if (skipped)
+				ImGui::Text("%d frames skipped, the gpu was more than %d frames behind", skipped, LATENCY);
+			ImGui::Separator();
+			ImGui::Columns(4, "sections");
+			ImGui::Text("section");
+			ImGui::NextColumn();
+			ImGui::Text("cpu ms");
+			ImGui::NextColumn();
+			ImGui::Text("gpu ms");
+			ImGui::NextColumn();
+			ImGui::Text("draws");
+			ImGui::NextColumn();
+			for (auto& s : sections)
+			{
+				ImGui::Text("%*s%s", s.depth * 2, "", s.name);
+				ImGui::NextColumn();
+				ImGui::Text("%.3f", s.cpu_ms);
+				ImGui::NextColumn();
+				ImGui::Text(gpu ? "%.3f" : "-", s.gpu_ms);
+				ImGui::NextColumn();
+				ImGui::Text("%u", s.draws);
+				ImGui::NextColumn();
+			}
+			ImGui::Columns(1);
+		}
+	};
+
+	bool gpu = false;
+	Frame frames[LATENCY];
+	int frame = 0;
+	std::vector<size_t> stack;
+	Summary summary;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	void init() { summary.gpu = gpu = GLEW_ARB_timer_query != 0; }
+
+	void destroy()
+	{
+		for (auto& f : frames)
+		{
+			if (!f.queries.empty())
+				glDeleteQueries((GLsizei)f.queries.size(), f.queries.data());
+			f = Frame();
+		}
+	}
+
+	double now() const { return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(); }
+
+	Frame& current() { return frames[frame % LATENCY]; }
+
+	GLuint timestamp()
+	{
+		if (!gpu)
+			return 0;
+		auto& f = current();
+		if (f.used == f.queries.size())
+		{
+			GLuint q;
+			glGenQueries(1, &q);
+			f.queries.push_back(q);
+		}
+		auto q = f.queries[f.used++];
+		glQueryCounter(q, GL_TIMESTAMP);
+		return q;
+	}
+
+	// timestamps complete in order, the frame's last one being available means all are
+	bool available(const Frame& f) const
+	{
+		if (!gpu)
+			return true;
+		GLuint ready = 0;
+		glGetQueryObjectuiv(f.gpu_end, GL_QUERY_RESULT_AVAILABLE, &ready);
+		return ready != 0;
+	}
+
+	double gpu_ms(GLuint begin, GLuint end) const
+	{
+		if (!gpu)
+			return 0.0;
+		GLuint64 a = 0;
+		GLuint64 b = 0;
+		glGetQueryObjectui64v(begin, GL_QUERY_RESULT, &a);
+		glGetQueryObjectui64v(end, GL_QUERY_RESULT, &b);
+		return (b - a) / 1e6;
+	}
+
+	int section(const char* name, int depth)
+	{
+		auto& sections = summary.sections;
+		for (size_t i = 0; i < sections.size(); i++)
+		{
+			if (sections[i].depth == depth && !strcmp(sections[i].name, name))
+				return (int)i;
+		}
+		sections.push_back(Section{ name, depth, 0.0, 0.0, 0 });
+		return (int)sections.size() - 1;
+	}
+
+	// reads a frame recorded LATENCY frames ago, only once available()
+	void resolve(Frame& f)
+	{
+		for (auto& s : summary.sections)
+		{
+			s.cpu_ms = s.gpu_ms = 0.0;
+			s.draws = 0;
+		}
+		for (auto& s : f.samples)
+		{
+			auto& section = summary.sections[s.section];
+			section.cpu_ms += s.cpu_end - s.cpu_begin;
+			section.gpu_ms += gpu_ms(s.gpu_begin, s.gpu_end);
+			section.draws += s.draws;
+		}
+		auto slot = summary.history_count++ % HISTORY;
+		summary.cpu_history[slot] = (float)(f.cpu_end - f.cpu_begin);
+		summary.gpu_history[slot] = (float)gpu_ms(f.gpu_begin, f.gpu_end);
+		f.pending = false;
+	}
+
+	void begin_frame()
+	{
+		auto& f = current();
+		// the slot is reused now: with the GPU more than LATENCY frames behind its results
+		// are dropped instead of waited for
+		if (f.pending && available(f))
+			resolve(f);
+		else if (f.pending)
+		{
+			summary.skipped++;
+			f.pending = false;
+		}
+		f.samples.clear();
+		f.used = 0;
+		stack.clear();
+		f.cpu_begin = now();
+		f.gpu_begin = timestamp();
+	}
+
+	void end_frame()
+	{
+		while (!stack.empty())
+			end();
+		auto& f = current();
+		f.cpu_end = now();
+		f.gpu_end = timestamp();
+		f.pending = true;
+		frame++;
+	}
+
+	void begin(const char* name)
+	{
+		auto& f = current();
+		Sample s;
+		s.section = section(name, (int)stack.size());
+		s.draws = 0;
+		s.cpu_begin = now();
+		s.gpu_begin = timestamp();
+		f.samples.push_back(s);
+		TRACE_BEGIN(name);
+		stack.push_back(f.samples.size() - 1);
+	}
+
+	void end()
+	{
+		auto& s = current().samples[stack.back()];
+		stack.pop_back();
+		s.cpu_end = now();
+		s.gpu_end = timestamp();
+		TRACE_END();
+	}
+
+	void count_draws(uint n = 1)
+	{
+		if (!stack.empty())
+			current().samples[stack.back()].draws += n;
+	}
+}profiler;
+
+struct ProfileScope
+{
+	ProfileScope(const char* name) { profiler.begin(name); }
+	~ProfileScope() { profiler.end(); }
+};
+
+// many copies of one model drawn with a single instanced call; the instance buffer holds
+// only the instances that survived culling and is rewritten in place when that set changes
+struct Crowd
+{
+	Model* model = nullptr;
+	std::vector<Instance> instances;
+	InstanceBuffer buffer;
+	GLuint attached_vao = 0;
+	bool dirty = true;
+	AABB bounds;
+	std::vector<AABB> instance_bounds;
+	std::vector<uint8_t> hidden; // culled instances are left out of the buffer
+	std::vector<Instance> shown;
+
+	void init(Model& m) { model = &m; }
+
+	void add(const Instance& inst)
+	{
+		instances.push_back(inst);
+		dirty = true;
+	}
+
+	// the model may still be loading, attach once its vertex array exists
+	void update()
+	{
+		if (model->mesh.vao != attached_vao)
+		{
+			buffer.attach(model->mesh, ATTRIB_INSTANCE_MAT, -1, ATTRIB_INSTANCE_TINT);
+			attached_vao = model->mesh.vao;
+			dirty = true;
+		}
+		if (!dirty)
+			return;
+		bounds = AABB();
+		instance_bounds.resize(instances.size());
+		for (size_t i = 0; i < instances.size(); i++)
+		{
+			instance_bounds[i] = model->mesh.bounds.transformed(instances[i].transform);
+			bounds.extend(instance_bounds[i]);
+		}
+		hidden.assign(instances.size(), 0);
+		buffer.reserve(instances.size(), GL_DYNAMIC_DRAW);
+		upload();
+		dirty = false;
+	}
+
+	void upload()
+	{
+		shown.clear();
+		for (size_t i = 0; i < instances.size(); i++)
+		{
+			if (!hidden[i])
+				shown.push_back(instances[i]);
+		}
+		buffer.update(shown, GL_DYNAMIC_DRAW);
+	}
+
+	// visible(index, world bounds) decides per instance, in parallel on the frame pool; the
+	// buffer is only rewritten when the set of shown instances changes
+	template<class F>
+	void cull(F visible)
+	{
+		std::atomic<bool> changed{ false };
+		pool.run(pool.size(), [&](int c) {
+			auto r = FramePool::range(instances.size(), c, pool.size());
+			auto chunk_changed = false;
+			for (auto i = r.first; i < r.second; i++)
+			{
+				uint8_t h = !visible(i, instance_bounds[i]);
+				chunk_changed |= h != hidden[i];
+				hidden[i] = h;
+			}
+			if (chunk_changed)
+				changed = true;
+		});
+		if (changed)
+			upload();
+	}
+
+	void destroy()
+	{
+		buffer.destroy();
+		attached_vao = 0;
+	}
+};
+
+// uniform blocks shared by the object programs, bound to fixed binding points at reflection
+const GLuint FRAME_BLOCK_BINDING = 0;
+const GLuint DRAW_BLOCK_BINDING = 1;
+const std::pair<const char*, GLuint> UNIFORM_BLOCK_BINDINGS[] = {
+	{ "Frame", FRAME_BLOCK_BINDING },
+	{ "Draw", DRAW_BLOCK_BINDING },
+};
+
+// texture units of the sampler uniforms, the queue only rebinds unit 0
+const std::pair<const char*, GLint> SAMPLER_UNITS[] = {
+	{ "tex", 0 },
+	{ "light_clusters", 1 },
+	{ "light_indices", 2 },
+	{ "light_data", 3 },
+	{ "gbuffer_albedo", 4 },
+	{ "gbuffer_normal", 5 },
+	{ "gbuffer_depth", 6 },
+};
+
+// std140 layout of the Frame block, vec3 members are padded to vec4
+struct FrameUniforms
+{
+	mat4 proj;
+	mat4 view;
+	vec4 camera_coord;
+	vec4 cluster_params;
+	mat4 inv_view_proj;
+};
+
+// std140 layout of the Draw block, mat3 columns are padded to vec4
+struct DrawUniforms
+{
+	mat4 model;
+	vec4 normal[3];
+};
+
+// active uniforms and uniform blocks of a linked program
+struct ProgramInfo
+{
+	GLuint program = 0;
+	std::map<std::string, GLint> uniforms; // default block uniforms, name -> location
+	std::map<std::string, GLint> blocks; // uniform blocks, name -> data size
+
+	GLint location(const std::string& name) const
+	{
+		auto it = uniforms.find(name);
+		return it == uniforms.end() ? -1 : it->second;
+	}
+
+	bool has_block(const std::string& name) const { return blocks.count(name) != 0; }
+};
+
+ProgramInfo reflect_program(GLuint program)
+{
+	ProgramInfo info;
+	info.program = program;
+
+	GLint count = 0;
+	GLint max_len = 0;
+	glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+	glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_len);
+	std::string name(std::max(max_len, 1), '\0');
+	for (auto i = 0; i < count; i++)
+	{
+		GLsizei len = 0;
+		GLint size;
+		GLenum type;
+		glGetActiveUniform(program, i, max_len, &len, &size, &type, &name[0]);
+		auto n = name.substr(0, len);
+		if (n.size() > 3 && n.compare(n.size() - 3, 3, "[0]") == 0)
+			n.resize(n.size() - 3);
+		// block members have no location
+		auto loc = glGetUniformLocation(program, n.c_str());
+		if (loc >= 0)
+			info.uniforms[n] = loc;
+	}
+
+	gl_state.use_program(program);
+	for (auto& s : SAMPLER_UNITS)
+	{
+		auto loc = info.location(s.first);
+		if (loc >= 0)
+			glUniform1i(loc, s.second);
+	}
+	gl_state.use_program(0);
+
+	if (!GLEW_ARB_uniform_buffer_object)
+		return info;
+	glGetProgramiv(program, GL_ACTIVE_UNIFORM_BLOCKS, &count);
+	glGetProgramiv(program, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &max_len);
+	name.assign(std::max(max_len, 1), '\0');
+	for (auto i = 0; i < count; i++)
+	{
+		GLsizei len = 0;
+		glGetActiveUniformBlockName(program, i, max_len, &len, &name[0]);
+		auto n = name.substr(0, len);
+		GLint size = 0;
+		glGetActiveUniformBlockiv(program, i, GL_UNIFORM_BLOCK_DATA_SIZE, &size);
+		info.blocks[n] = size;
+		for (auto& b : UNIFORM_BLOCK_BINDINGS)
+		{
+			if (n == b.first)
+				glUniformBlockBinding(program, i, b.second);
+		}
+	}
+	return info;
+}
+
+struct DrawPacket
+{
+	const Mesh* mesh = nullptr;
+	GLuint texture = 0;
+	uint8_t program = 0; // slot returned by RenderQueue::add_program
+	GLsizei instance_count = 0; // 0 draws once with the model/normal uniforms below
+	mat4 model;
+	mat3 normal;
+	void (*callback)() = nullptr; // custom draw instead of the mesh, e.g. immediate mode
+	uint32_t draw_offset = 0; // offset of the packed DrawUniforms, set by execute()
+};
+
+// packets and sort keys recorded by one thread, merged into the queue on the GL thread
+struct DrawList
+{
+	std::vector<DrawPacket> packets;
+	std::vector<uint64_t> keys;
+
+	void clear()
+	{
+		packets.clear();
+		keys.clear();
+	}
+};
+
+struct SortItem
+{
+	uint64_t key;
+	uint32_t index;
+};
+
+// LSD radix sort, 8 bit digits, passes where every key has the same digit are skipped
+void radix_sort(std::vector<SortItem>& items, std::vector<SortItem>& tmp)
+{
+	if (items.size() < 2)
+		return;
+	tmp.resize(items.size());
+	for (auto shift = 0; shift < 64; shift += 8)
+	{
+		size_t count[256] = {};
+		for (auto& it : items)
+			count[(it.key >> shift) & 0xff]++;
+		if (count[(items[0].key >> shift) & 0xff] == items.size())
+			continue;
+		size_t sum = 0;
+		for (auto& c : count)
+		{
+			auto n = c;
+			c = sum;
+			sum += n;
+		}
+		for (auto& it : items)
+			tmp[count[(it.key >> shift) & 0xff]++] = it;
+		items.swap(tmp);
+	}
+}
+
+// draws are collected per frame, sorted by a 64 bit key and replayed with redundant
+// program/texture/vertex array binds skipped; key layout from the top:
+//   8 bits program slot | 16 bits texture | 16 bits vertex array | 24 bits view depth
+// so state groups come first and each group is drawn front to back for early-Z.
+// Per-frame uniforms are written once into the Frame block; per-draw matrices of every
+// packet are packed into one Draw block range selected with glBindBufferRange, both
+// streamed through the ring buffer.
+// The sorted packets can be replayed more than once per frame, e.g. a depth-only pass
+// with each program's depth counterpart before the shaded pass
+struct RenderQueue
+{
+	struct Program
+	{
+		ProgramInfo info;
+		bool draw_block;
+		GLint position_offset_loc;
+		GLint position_scale_loc;
+		int depth_slot = -1; // program used by depth-only passes, -1 skips the packet there
+		const char* name = "draws"; // profiler section of the shaded pass
+	};
+
+	struct Stats
+	{
+		uint draws = 0;
+		uint program_binds = 0;
+		uint texture_binds = 0;
+		uint mesh_binds = 0;
+	};
+
+	std::vector<Program> programs;
+	std::vector<DrawPacket> packets;
+	std::vector<SortItem> items;
+	std::vector<SortItem> tmp;
+	std::vector<uint8_t> draw_data;
+	RingBuffer::Allocation draw_alloc = {};
+	GLint ubo_align = 256;
+	bool prepared = false;
+	mat4 view;
+	Stats stats; // over all passes of the frame
+
+	void init() { glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &ubo_align); }
+
+	static Program make_program(GLuint program)
+	{
+		Program p;
+		p.info = reflect_program(program);
+		p.draw_block = p.info.has_block("Draw");
+		p.position_offset_loc = p.info.location("position_offset");
+		p.position_scale_loc = p.info.location("position_scale");
+		if (p.info.has_block("Frame") && p.info.blocks["Frame"] > (GLint)sizeof(FrameUniforms))
+			printf("Frame block of program %u is larger than FrameUniforms\n", program);
+		return p;
+	}
+
+	// depth_program must produce the same positions (invariant gl_Position) and read the
+	// same uniform blocks, only its fragment stage differs
+	uint8_t add_program(GLuint program, GLuint depth_program = 0, const char* name = "draws")
+	{
+		auto p = make_program(program);
+		p.name = name;
+		if (depth_program)
+		{
+			programs.push_back(make_program(depth_program));
+			p.depth_slot = (int)programs.size() - 1;
+		}
+		programs.push_back(std::move(p));
+		return (uint8_t)(programs.size() - 1);
+	}
+
+	// once per frame, every program reads it through FRAME_BLOCK_BINDING
+	void set_frame(const FrameUniforms& frame)
+	{
+		auto a = ring.write(&frame, sizeof(frame), ubo_align);
+		glBindBufferRange(GL_UNIFORM_BUFFER, FRAME_BLOCK_BINDING, a.buffer, a.offset, sizeof(frame));
+	}
+
+	void begin(const mat4& view_mat)
+	{
+		view = view_mat;
+		packets.clear();
+		items.clear();
+		prepared = false;
+		stats = Stats();
+	}
+
+	static uint64_t depth_key(float depth)
+	{
+		// positive floats order like their bit patterns, keep the top 24 bits
+		uint32_t bits;
+		depth = std::max(depth, 0.f);
+		memcpy(&bits, &depth, sizeof(bits));
+		return bits >> 8;
+	}
+
+	// center is the world position used for front to back ordering inside a state group
+	uint64_t key(uint8_t program, GLuint texture, const Mesh* mesh, const vec3& center) const
+	{
+		auto depth = -(view * vec4(center, 1.f)).z;
+		return (uint64_t)program << 56 |
+			(uint64_t)(texture & 0xffff) << 40 |
+			(uint64_t)((mesh ? mesh->vao : 0) & 0xffff) << 24 |
+			depth_key(depth);
+	}
+
+	DrawPacket& submit(uint8_t program, GLuint texture, const Mesh* mesh, const vec3& center)
+	{
+		SortItem item;
+		item.key = key(program, texture, mesh, center);
+		item.index = (uint32_t)packets.size();
+		items.push_back(item);
+		packets.emplace_back();
+		auto& p = packets.back();
+		p.program = program;
+		p.texture = texture;
+		p.mesh = mesh;
+		return p;
+	}
+
+	// thread safe between begin() and merge(), each thread records into its own list
+	DrawPacket& submit(DrawList& list, uint8_t program, GLuint texture, const Mesh* mesh, const vec3& center) const
+	{
+		list.keys.push_back(key(program, texture, mesh, center));
+		list.packets.emplace_back();
+		auto& p = list.packets.back();
+		p.program = program;
+		p.texture = texture;
+		p.mesh = mesh;
+		return p;
+	}
+
+	void merge(DrawList& list)
+	{
+		for (size_t i = 0; i < list.packets.size(); i++)
+		{
+			items.push_back(SortItem{ list.keys[i], (uint32_t)packets.size() });
+			packets.push_back(list.packets[i]);
+		}
+		list.clear();
+	}
+
+	// offsets are assigned in sorted order, the matrices are then copied in parallel
+	void pack_draw_data()
+	{
+		auto stride = align_up(sizeof(DrawUniforms), ubo_align);
+		size_t size = 0;
+		for (auto& item : items)
+		{
+			auto& p = packets[item.index];
+			if (p.instance_count || p.callback || !programs[p.program].draw_block)
+				continue;
+			p.draw_offset = (uint32_t)size;
+			size += stride;
+		}
+		draw_data.resize(size);
+		pool.run(pool.size(), [&](int c) {
+			auto r = FramePool::range(items.size(), c, pool.size());
+			for (auto i = r.first; i < r.second; i++)
+			{
+				auto& p = packets[items[i].index];
+				if (p.instance_count || p.callback || !programs[p.program].draw_block)
+					continue;
+				DrawUniforms d;
+				d.model = p.model;
+				for (auto k = 0; k < 3; k++)
+					d.normal[k] = vec4(p.normal[k], 0.f);
+				memcpy(draw_data.data() + p.draw_offset, &d, sizeof(d));
+			}
+		});
+		if (!draw_data.empty())
+			draw_alloc = ring.write(draw_data.data(), draw_data.size(), ubo_align);
+	}
+
+	// sorts and uploads the per-draw data on the first pass of the frame
+	void execute(bool depth_only = false)
+	{
+		if (!prepared)
+		{
+			radix_sort(items, tmp);
+			pack_draw_data();
+			prepared = true;
+		}
+		auto cur_program = -1;
+		auto cur_texture = ~0U;
+		const Mesh* cur_mesh = nullptr;
+		for (auto& item : items)
+		{
+			auto& p = packets[item.index];
+			auto slot = depth_only ? programs[p.program].depth_slot : (int)p.program;
+			if (slot < 0)
+				continue;
+			auto& prog = programs[slot];
+			if (slot != cur_program)
+			{
+				// program runs are contiguous after the sort, each is one profiler section
+				if (!depth_only)
+				{
+					if (cur_program >= 0)
+						profiler.end();
+					profiler.begin(prog.name);
+				}
+				gl_state.use_program(prog.info.program);
+				cur_program = slot;
+				cur_mesh = nullptr;
+				stats.program_binds++;
+			}
+			if (!depth_only && p.texture != cur_texture)
+			{
+				gl_state.bind_texture(p.texture);
+				cur_texture = p.texture;
+				stats.texture_binds++;
+			}
+			if (p.callback)
+			{
+				gl_state.bind_vertex_array(0);
+				cur_mesh = nullptr;
+				p.callback();
+				stats.draws++;
+				profiler.count_draws();
+				continue;
+			}
+			if (!p.mesh || !p.mesh->index_count)
+				continue;
+			if (p.mesh != cur_mesh)
+			{
+				gl_state.bind_vertex_array(p.mesh->vao);
+				cur_mesh = p.mesh;
+				stats.mesh_binds++;
+				if (prog.position_offset_loc >= 0)
+				{
+					auto range = p.mesh->bounds.max - p.mesh->bounds.min;
+					glUniform3fv(prog.position_offset_loc, 1, &p.mesh->bounds.min[0]);
+					glUniform3fv(prog.position_scale_loc, 1, &range[0]);
+				}
+			}
+			if (p.instance_count)
+				glDrawElementsInstanced(GL_TRIANGLES, p.mesh->index_count, p.mesh->index_type, nullptr, p.instance_count);
+			else
+			{
+				if (prog.draw_block)
+					glBindBufferRange(GL_UNIFORM_BUFFER, DRAW_BLOCK_BINDING, draw_alloc.buffer, draw_alloc.offset + p.draw_offset, sizeof(DrawUniforms));
+				glDrawElements(GL_TRIANGLES, p.mesh->index_count, p.mesh->index_type, nullptr);
+			}
+			stats.draws++;
+			profiler.count_draws();
+		}
+		if (!depth_only && cur_program >= 0)
+			profiler.end();
+		gl_state.bind_vertex_array(0);
+		gl_state.use_program(0);
+	}
+}queue;
+
+// 0 if compiling fails, the log is printed
+GLuint create_shader(GLuint type, const std::string& source)
+{
+	TRACE_ZONE(type == GL_VERTEX_SHADER ? "compile vertex shader" : "compile fragment shader");
+	auto ret = glCreateShader(type);
+	const char* sources[] = {
+		source.c_str()
+	};
+	int lengths[] = {
+		source.size()
+	};
+	glShaderSource(ret, 1, sources, lengths);
+	glCompileShader(ret);
+	int ok;
+	glGetShaderiv(ret, GL_COMPILE_STATUS, &ok);
+	if (ok == GL_FALSE)
+	{
+		int len;
+		glGetShaderiv(ret, GL_INFO_LOG_LENGTH, &len);
+		std::string str;
+		str.resize(len);
+		glGetShaderInfoLog(ret, str.size(), &len, (char*)str.data());
+		printf("%s\n", str.c_str());
+		glDeleteShader(ret);
+		return 0;
+	}
+	return ret;
+}
+
+// compiles and links, the shaders are released once linked; 0 if any step fails
+GLuint create_program(const std::string& vertex_source, const std::string& fragment_source,
+	std::initializer_list<std::pair<GLuint, const char*>> attrib_locations = {})
+{
+	auto vertex_shader = create_shader(GL_VERTEX_SHADER, vertex_source);
+	auto fragment_shader = create_shader(GL_FRAGMENT_SHADER, fragment_source);
+	if (!vertex_shader || !fragment_shader)
+	{
+		glDeleteShader(vertex_shader);
+		glDeleteShader(fragment_shader);
+		return 0;
+	}
+	TRACE_ZONE("link program");
+	auto ret = glCreateProgram();
+	glAttachShader(ret, vertex_shader);
+	glAttachShader(ret, fragment_shader);
+	for (auto& a : attrib_locations)
+		glBindAttribLocation(ret, a.first, a.second);
+	if (GLEW_ARB_get_program_binary)
+		glProgramParameteri(ret, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(ret);
+	glDetachShader(ret, vertex_shader);
+	glDetachShader(ret, fragment_shader);
+	glDeleteShader(vertex_shader);
+	glDeleteShader(fragment_shader);
+	int ok;
+	glGetProgramiv(ret, GL_LINK_STATUS, &ok);
+	if (ok == GL_FALSE)
+	{
+		int len;
+		glGetProgramiv(ret, GL_INFO_LOG_LENGTH, &len);
+		std::string str;
+		str.resize(len);
+		glGetProgramInfoLog(ret, str.size(), &len, (char*)str.data());
+		printf("%s\n", str.c_str());
+		glDeleteProgram(ret);
+		return 0;
+	}
+	return ret;
+}
+
+// linked program binaries, keyed by the shader sources, attribute bindings and driver;
+// stored as <dir>/<key>.bin: ProgramBinaryHeader followed by the glGetProgramBinary blob
+const char* SHADER_CACHE_DIR = "shader_cache";
+const uint32_t PROGRAM_BINARY_MAGIC = 0x47525042; // "BPRG"
+const uint32_t PROGRAM_BINARY_VERSION = 1;
+
+struct ProgramBinaryHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;
+	uint32_t format;
+	uint32_t length;
+};
+
+bool program_binary_supported()
+{
+	if (!GLEW_ARB_get_program_binary)
+		return false;
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	return formats > 0;
+}
+
+void make_dir(const char* path)
+{
+#ifdef _WIN32
+	CreateDirectoryA(path, nullptr);
+#else
+	mkdir(path, 0755);
+#endif
+}
+
+// loads the program from the binary cache, compiles and stores it on a miss or when the driver
+// rejects the binary; 0 (fixed function) if the sources don't compile, which is never cached
+GLuint load_program(const std::string& vertex_source, const std::string& fragment_source,
+	std::initializer_list<std::pair<GLuint, const char*>> attrib_locations = {})
+{
+	TRACE_ZONE("load_program");
+	static const auto cache = program_binary_supported();
+	if (!cache)
+		return create_program(vertex_source, fragment_source, attrib_locations);
+
+	static const auto driver = std::string((const char*)glGetString(GL_VENDOR)) +
+		(const char*)glGetString(GL_RENDERER) + (const char*)glGetString(GL_VERSION);
+	auto key = hash_bytes(driver.data(), driver.size());
+	key = hash_bytes(vertex_source.data(), vertex_source.size(), key);
+	key = hash_bytes(fragment_source.data(), fragment_source.size(), key);
+	for (auto& a : attrib_locations)
+	{
+		key = hash_bytes(&a.first, sizeof(a.first), key);
+		key = hash_bytes(a.second, strlen(a.second), key);
+	}
+	char path[256];
+	snprintf(path, sizeof(path), "%s/%016llx.bin", SHADER_CACHE_DIR, (unsigned long long)key);
+
+	{
+		MappedFile f;
+		if (f.open(path) && f.size >= sizeof(ProgramBinaryHeader))
+		{
+			auto& header = *(const ProgramBinaryHeader*)f.data;
+			if (header.magic == PROGRAM_BINARY_MAGIC && header.version == PROGRAM_BINARY_VERSION &&
+				header.key == key && sizeof(header) + header.length <= f.size)
+			{
+				TRACE_ZONE("program binary");
+				auto ret = glCreateProgram();
+				glProgramBinary(ret, header.format, f.data + sizeof(header), header.length);
+				int ok;
+				glGetProgramiv(ret, GL_LINK_STATUS, &ok);
+				if (ok == GL_TRUE)
+					return ret;
+				glDeleteProgram(ret);
+				printf("program binary %s rejected, recompiling\n", path);
+			}
+		}
+	}
+
+	auto ret = create_program(vertex_source, fragment_source, attrib_locations);
+	if (!ret)
+		return 0;
+
+	GLint len = 0;
+	glGetProgramiv(ret, GL_PROGRAM_BINARY_LENGTH, &len);
+	if (len <= 0)
+		return ret;
+	std::vector<uint8_t> blob(len);
+	ProgramBinaryHeader header;
+	header.magic = PROGRAM_BINARY_MAGIC;
+	header.version = PROGRAM_BINARY_VERSION;
+	header.key = key;
+	GLenum format = 0;
+	glGetProgramBinary(ret, len, &len, &format, blob.data());
+	header.format = format;
+	header.length = (uint32_t)len;
+
+	make_dir(SHADER_CACHE_DIR);
+	auto tmp_path = std::string(path) + ".tmp";
+	auto fp = fopen(tmp_path.c_str(), "wb");
+	if (!fp)
+		return ret;
+	auto ok = fwrite(&header, sizeof(header), 1, fp) == 1 && fwrite(blob.data(), 1, len, fp) == (size_t)len;
+	fclose(fp);
+	remove(path);
+	if (!ok || rename(tmp_path.c_str(), path) != 0)
+		remove(tmp_path.c_str());
+	return ret;
+}
+
+struct Camera
+{
+	vec3 coord = vec3(0.f, 1.f, 0.f);
+	float x_angle = 0.f;
+	float y_angle = 0.f;
+	vec3 forward_dir;
+	vec3 side_dir;
+	bool forward = false;
+	bool backward = false;
+	bool left = false;
+	bool right = false;
+
+	float speed = 6.f; // units per second
+
+	bool moving() const { return forward || backward || left || right; }
+
+	// dt is the real frame time, the camera is input and isn't stepped with the simulation
+	mat4 update(float dt)
+	{
+		mat4 rot;
+		rot = rotate(mat4(1.f), radians(x_angle), vec3(0.f, 1.f, 0.f));
+		rot = rotate(rot,		radians(y_angle), vec3(1.f, 0.f, 0.f));
+		forward_dir = -rot[2];
+		side_dir = rot[0];
+
+		auto d = speed * dt;
+		if (forward)
+			coord += forward_dir * d;
+		if (backward)
+			coord -= forward_dir * d;
+		if (left)
+			coord -= side_dir * d;
+		if (right)
+			coord += side_dir * d;
+
+		return inverse(translate(mat4(1.f), coord) * rot);
+	}
+}camera;
+
+struct Frustum
+{
+	vec4 planes[6]; // xyz inward normal, w distance
+
+	// Gribb/Hartmann plane extraction from a combined projection * view matrix
+	void extract(const mat4& m)
+	{
+		auto row = [&](int i) { return vec4(m[0][i], m[1][i], m[2][i], m[3][i]); };
+		planes[0] = row(3) + row(0);
+		planes[1] = row(3) - row(0);
+		planes[2] = row(3) + row(1);
+		planes[3] = row(3) - row(1);
+		planes[4] = row(3) + row(2);
+		planes[5] = row(3) - row(2);
+		for (auto& p : planes)
+			p /= length(vec3(p));
+	}
+
+	// box is in world space
+	bool visible(const AABB& box) const
+	{
+		if (box.empty())
+			return false;
+		auto c = box.center();
+		auto e = box.extents();
+		for (auto& p : planes)
+		{
+			auto n = vec3(p);
+			if (dot(n, c) + p.w + dot(abs(n), e) < 0.f)
+				return false;
+		}
+		return true;
+	}
+};
+
+template<class T, size_t N>
+constexpr size_t size(T(&)[N]) { return N; }
+
+struct PointLight
+{
+	vec3 position;
+	float radius; // no light beyond this distance
+	vec3 color;
+	float intensity;
+};
+
+const int CLUSTER_X = 16;
+const int CLUSTER_Y = 9;
+const int CLUSTER_Z = 24;
+const int LIGHT_TEXTURE_WIDTH = 1024; // light data and index lists are wrapped into rows
+
+// clustered forward lighting: every frame the lights are binned on the CPU into a
+// CLUSTER_X * CLUSTER_Y screen tiles * CLUSTER_Z exponential depth slices grid, the
+// fragment shader finds its cluster from gl_FragCoord and view depth and only loops
+// over that cluster's lights. The data is passed in integer/float textures:
+//   light_clusters  RG32UI, one texel per cluster: offset and count into light_indices
+//   light_indices   R32UI, light index lists of all clusters back to back
+//   light_data      RGBA32F, two texels per light: position + radius, color * intensity
+struct LightClusters
+{
+	struct Texture
+	{
+		GLuint id = 0;
+		int rows = 0;
+	};
+
+	struct Range
+	{
+		int x0, x1, y0, y1, z0, z1;
+	};
+
+	Texture clusters;
+	Texture indices;
+	Texture lights;
+	float near_plane = 1.f;
+	float far_plane = 1000.f;
+	std::vector<Range> ranges;
+	std::vector<uint32_t> offsets;
+	std::vector<uint32_t> grid;
+	std::vector<uint32_t> index_list;
+	std::vector<vec4> light_data;
+	uint32_t max_cluster_lights = 0;
+
+	static void create(Texture& t, GLenum internal, GLenum format, GLenum type, int width, int rows)
+	{
+		glGenTextures(1, &t.id);
+		gl_state.bind_texture(t.id);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, internal, width, rows, 0, format, type, nullptr);
+		t.rows = rows;
+	}
+
+	// grows by doubling, so the storage is only reallocated while the light count rises
+	static void upload(Texture& t, GLenum internal, GLenum format, GLenum type, const void* data, int rows)
+	{
+		gl_state.bind_texture(t.id);
+		if (rows > t.rows)
+		{
+			t.rows = std::max(rows, t.rows * 2);
+			glTexImage2D(GL_TEXTURE_2D, 0, internal, LIGHT_TEXTURE_WIDTH, t.rows, 0, format, type, nullptr);
+		}
+		if (rows)
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, LIGHT_TEXTURE_WIDTH, rows, format, type, data);
+	}
+
+	static int rows(size_t texels) { return (int)((texels + LIGHT_TEXTURE_WIDTH - 1) / LIGHT_TEXTURE_WIDTH); }
+
+	// near and far must match the projection
+	void init(float near, float far)
+	{
+		near_plane = near;
+		far_plane = far;
+		create(clusters, GL_RG32UI, GL_RG_INTEGER, GL_UNSIGNED_INT, CLUSTER_X * CLUSTER_Y, CLUSTER_Z);
+		create(indices, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, LIGHT_TEXTURE_WIDTH, 1);
+		create(lights, GL_RGBA32F, GL_RGBA, GL_FLOAT, LIGHT_TEXTURE_WIDTH, 1);
+		gl_state.bind_texture(0);
+	}
+
+	// view space bounding box of the light sphere projected to cluster ranges; boxes
+	// reaching the near plane cover the whole screen
+	bool range(const PointLight& l, const mat4& proj, const mat4& view, Range& r) const
+	{
+		auto c = vec3(view * vec4(l.position, 1.f));
+		auto z_near = -c.z - l.radius;
+		auto z_far = -c.z + l.radius;
+		if (z_far < near_plane || z_near > far_plane)
+			return false;
+		auto log_scale = CLUSTER_Z / log(far_plane / near_plane);
+		r.z0 = z_near <= near_plane ? 0 : std::min(CLUSTER_Z - 1, (int)(log(z_near / near_plane) * log_scale));
+		r.z1 = std::min(CLUSTER_Z - 1, (int)(log(z_far / near_plane) * log_scale));
+		r.x0 = r.y0 = 0;
+		r.x1 = CLUSTER_X - 1;
+		r.y1 = CLUSTER_Y - 1;
+		if (z_near <= near_plane)
+			return true;
+
+		vec2 lo(FLT_MAX);
+		vec2 hi(-FLT_MAX);
+		for (auto z : { z_near, z_far })
+		{
+			for (auto s : { -1.f, 1.f })
+			{
+				auto ndc = vec2(proj[0][0] * (c.x + s * l.radius), proj[1][1] * (c.y + s * l.radius)) / z;
+				lo = min(lo, ndc);
+				hi = max(hi, ndc);
+			}
+		}
+		if (hi.x < -1.f || hi.y < -1.f || lo.x > 1.f || lo.y > 1.f)
+			return false;
+		auto tile = [](float ndc, int count) { return clamp((int)((ndc * 0.5f + 0.5f) * count), 0, count - 1); };
+		r.x0 = tile(lo.x, CLUSTER_X);
+		r.x1 = tile(hi.x, CLUSTER_X);
+		r.y0 = tile(lo.y, CLUSTER_Y);
+		r.y1 = tile(hi.y, CLUSTER_Y);
+		return true;
+	}
+
+	template<class F>
+	static void for_each_cluster(const Range& r, F f)
+	{
+		for (auto z = r.z0; z <= r.z1; z++)
+			for (auto y = r.y0; y <= r.y1; y++)
+				for (auto x = r.x0; x <= r.x1; x++)
+					f((z * CLUSTER_Y + y) * CLUSTER_X + x);
+	}
+
+	// without bin only the light data is uploaded, all clusters stay empty
+	void update(const std::vector<PointLight>& scene_lights, const mat4& proj, const mat4& view, bool bin = true)
+	{
+		const auto cluster_count = CLUSTER_X * CLUSTER_Y * CLUSTER_Z;
+		grid.assign(cluster_count * 2, 0);
+		ranges.resize(scene_lights.size());
+		light_data.assign(rows(scene_lights.size() * 2) * LIGHT_TEXTURE_WIDTH, vec4(0.f));
+
+		// count lights per cluster
+		for (size_t i = 0; i < scene_lights.size(); i++)
+		{
+			auto& l = scene_lights[i];
+			light_data[i * 2] = vec4(l.position, l.radius);
+			light_data[i * 2 + 1] = vec4(l.color * l.intensity, 0.f);
+			if (!bin || !range(l, proj, view, ranges[i]))
+			{
+				ranges[i] = Range{ 0, -1, 0, -1, 0, -1 };
+				continue;
+			}
+			for_each_cluster(ranges[i], [&](int k) { grid[k * 2 + 1]++; });
+		}
+
+		// prefix sum into offsets, then scatter the light indices
+		offsets.resize(cluster_count);
+		uint32_t total = 0;
+		max_cluster_lights = 0;
+		for (auto k = 0; k < cluster_count; k++)
+		{
+			grid[k * 2] = offsets[k] = total;
+			total += grid[k * 2 + 1];
+			max_cluster_lights = std::max(max_cluster_lights, grid[k * 2 + 1]);
+		}
+		index_list.assign(rows(total) * LIGHT_TEXTURE_WIDTH, 0);
+		for (size_t i = 0; i < scene_lights.size(); i++)
+			for_each_cluster(ranges[i], [&](int k) { index_list[offsets[k]++] = (uint32_t)i; });
+
+		gl_state.bind_texture(clusters.id);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, CLUSTER_X * CLUSTER_Y, CLUSTER_Z, GL_RG_INTEGER, GL_UNSIGNED_INT, grid.data());
+		upload(indices, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, index_list.data(), rows(total));
+		upload(lights, GL_RGBA32F, GL_RGBA, GL_FLOAT, light_data.data(), rows(scene_lights.size() * 2));
+		gl_state.bind_texture(0);
+	}
+
+	// x, y: clusters per pixel, z: slices per log depth, w: log near plane
+	vec4 params(int width, int height) const
+	{
+		return vec4((float)CLUSTER_X / width, (float)CLUSTER_Y / height,
+			CLUSTER_Z / log(far_plane / near_plane), log(near_plane));
+	}
+
+	void bind() const
+	{
+		GLuint ids[] = { clusters.id, indices.id, lights.id };
+		for (auto i = 0; i < 3; i++)
+		{
+			gl_state.active_texture(GL_TEXTURE1 + i);
+			gl_state.bind_texture(ids[i]);
+		}
+		gl_state.active_texture(GL_TEXTURE0);
+	}
+
+	void destroy()
+	{
+		for (auto t : { &clusters, &indices, &lights })
+		{
+			glDeleteTextures(1, &t->id);
+			gl_state.deleted_texture(t->id);
+			*t = Texture();
+		}
+	}
+}light_clusters;
+
+enum class Shading { Forward, Deferred };
+
+// deferred shading: the scene is drawn once into albedo/normal/depth targets, then an
+// ambient pass shades every pixel once and each point light adds its contribution
+// through an instanced box volume, reading the lights from the clustered light data.
+// normal.w is 0 for unlit pixels (background, grid), which keep their albedo
+struct GBuffer
+{
+	GLuint fbo = 0;
+	GLuint albedo = 0;
+	GLuint normal = 0;
+	GLuint depth = 0;
+	int width = 0;
+	int height = 0;
+
+	static GLuint create_target(GLenum internal, GLenum format, GLenum type, int width, int height)
+	{
+		GLuint tex;
+		glGenTextures(1, &tex);
+		gl_state.bind_texture(tex);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, internal, width, height, 0, format, type, nullptr);
+		return tex;
+	}
+
+	void resize(int w, int h)
+	{
+		if (fbo && w == width && h == height)
+			return;
+		destroy();
+		width = w;
+		height = h;
+		albedo = create_target(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, w, h);
+		normal = create_target(GL_RGBA16F, GL_RGBA, GL_FLOAT, w, h);
+		depth = create_target(GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, w, h);
+		gl_state.bind_texture(0);
+		glGenFramebuffers(1, &fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, albedo, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, normal, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth, 0);
+		GLenum buffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+		glDrawBuffers(2, buffers);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			printf("g-buffer framebuffer incomplete\n");
+	}
+
+	// albedo is cleared to the background color
+	void begin(int w, int h, const vec4& clear_color)
+	{
+		resize(w, h);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		const float no_normal[] = { 0.f, 0.f, 0.f, 0.f };
+		const float far_depth = 1.f;
+		glClearBufferfv(GL_COLOR, 0, &clear_color[0]);
+		glClearBufferfv(GL_COLOR, 1, no_normal);
+		glClearBufferfv(GL_DEPTH, 0, &far_depth);
+	}
+
+	// resolves into target; light volumes are drawn back faces only so each covered
+	// pixel is shaded once per light, also with the camera inside the volume
+	void light(GLuint ambient_program, GLuint point_program, GLsizei light_count, GLuint target)
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, target);
+		GLuint ids[] = { albedo, normal, depth };
+		for (auto i = 0; i < 3; i++)
+		{
+			gl_state.active_texture(GL_TEXTURE4 + i);
+			gl_state.bind_texture(ids[i]);
+		}
+		gl_state.active_texture(GL_TEXTURE0);
+		gl_state.disable(GL_DEPTH_TEST);
+		gl_state.depth_mask(GL_FALSE);
+
+		gl_state.use_program(ambient_program);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+
+		if (light_count)
+		{
+			gl_state.enable(GL_BLEND);
+			gl_state.blend_func(GL_ONE, GL_ONE);
+			gl_state.cull_face(GL_FRONT);
+			gl_state.use_program(point_program);
+			glDrawArraysInstanced(GL_TRIANGLES, 0, 36, light_count);
+			gl_state.cull_face(GL_BACK);
+			gl_state.disable(GL_BLEND);
+		}
+
+		gl_state.use_program(0);
+		gl_state.depth_mask(GL_TRUE);
+		gl_state.enable(GL_DEPTH_TEST);
+	}
+
+	void destroy()
+	{
+		glDeleteFramebuffers(1, &fbo);
+		for (auto t : { &albedo, &normal, &depth })
+		{
+			glDeleteTextures(1, t);
+			gl_state.deleted_texture(*t);
+			*t = 0;
+		}
+		fbo = 0;
+	}
+}gbuffer;
+
+// depth pre-pass: the opaque draws first go through depth-only programs with color writes
+// off, then the shaded pass runs with GL_EQUAL and depth writes off so every covered
+// pixel is lit exactly once. It costs a second geometry pass, so in auto mode it is only
+// enabled while the measured overdraw is above the threshold: the samples passing the
+// shaded pass without pre-pass (fragments lit) are compared to the samples with it
+// (visible pixels). Queries are read a few frames late and the other mode is probed
+// now and then so both numbers stay current
+struct DepthPrepass
+{
+	enum Mode { Off, On, Auto };
+
+	Mode mode = Auto;
+	float threshold = 1.3f;
+	int probe_interval = 120;
+
+	bool active = false;
+	int frame = 0;
+	GLuint queries[4] = {};
+	bool query_prepass[4] = {};
+	double lit_samples = 0; // latest shaded pass without pre-pass
+	double visible_samples = 0; // latest shaded pass with pre-pass
+
+	void parse(int argc, char** argv)
+	{
+		for (auto i = 1; i + 1 < argc; i++)
+		{
+			if (strcmp(argv[i], "--prepass"))
+				continue;
+			auto v = argv[++i];
+			mode = !strcmp(v, "on") ? On : !strcmp(v, "off") ? Off : Auto;
+		}
+	}
+
+	void init() { glGenQueries((GLsizei)size(queries), queries); }
+
+	void destroy() { glDeleteQueries((GLsizei)size(queries), queries); }
+
+	float overdraw() const { return visible_samples > 0 ? (float)(lit_samples / visible_samples) : 1.f; }
+
+	void read_query(int f)
+	{
+		auto q = queries[f % size(queries)];
+		GLuint available = 0;
+		glGetQueryObjectuiv(q, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			return;
+		GLuint64 samples = 0;
+		glGetQueryObjectui64v(q, GL_QUERY_RESULT, &samples);
+		(query_prepass[f % size(queries)] ? visible_samples : lit_samples) = (double)samples;
+	}
+
+	// decides whether this frame uses the pre-pass
+	bool begin_frame()
+	{
+		if (frame >= (int)size(queries))
+			read_query(frame - size(queries));
+		if (mode != Auto)
+			active = mode == On;
+		else if (!visible_samples)
+			active = true;
+		else if (!lit_samples)
+			active = false;
+		else
+		{
+			active = overdraw() > threshold;
+			if (frame % probe_interval == 0)
+				active = !active;
+		}
+		return active;
+	}
+
+	void begin_shading()
+	{
+		query_prepass[frame % size(queries)] = active;
+		glBeginQuery(GL_SAMPLES_PASSED, queries[frame % size(queries)]);
+	}
+
+	void end_shading()
+	{
+		glEndQuery(GL_SAMPLES_PASSED);
+		frame++;
+	}
+
+	static const char* name(Mode m) { return m == On ? "on" : m == Off ? "off" : "auto"; }
+	const char* name() const { return name(mode); }
+}prepass;
+
+// occlusion culling with hardware queries: after the shaded pass the bounding boxes of
+// the objects to test are drawn against the frame's depth with color and depth writes
+// off, one query each. Results are collected a frame later without waiting, so a hidden
+// object reappears one frame late. Occluded objects are tested every frame, visible ones
+// only every retest_interval frames (staggered by id); objects the camera is inside of
+// are always visible. Ids must stay stable across frames. Query results are polled on the
+// GL thread in begin_frame(), visible() only touches its own object and can run on any
+// thread
+struct OcclusionCuller
+{
+	struct Object
+	{
+		GLuint query = 0;
+		bool pending = false;
+		bool visible = true;
+		bool due = false; // box is tested this frame
+		int tested_frame = 0;
+		int seen_frame = -1;
+		AABB box;
+	};
+
+	struct Stats
+	{
+		uint tested = 0;
+		uint occluded = 0;
+	};
+
+	bool enabled = true;
+	int retest_interval = 8;
+	float margin = 0.05f; // boxes are grown so they never coincide with the object's own depth
+	GLenum target = GL_SAMPLES_PASSED;
+	GLuint program = 0;
+	GLint box_min_loc = -1;
+	GLint box_max_loc = -1;
+	std::vector<Object> objects;
+	int frame = 0;
+	Stats stats;
+
+	void parse(int argc, char** argv)
+	{
+		for (auto i = 1; i + 1 < argc; i++)
+		{
+			if (!strcmp(argv[i], "--occlusion"))
+				enabled = strcmp(argv[++i], "off") != 0;
+		}
+	}
+
+	void init(GLuint box_program)
+	{
+		program = box_program;
+		auto info = reflect_program(program);
+		box_min_loc = info.location("box_min");
+		box_max_loc = info.location("box_max");
+		if (GLEW_ARB_occlusion_query2)
+			target = GL_ANY_SAMPLES_PASSED;
+	}
+
+	void destroy()
+	{
+		for (auto& o : objects)
+			glDeleteQueries(1, &o.query);
+		objects.clear();
+	}
+
+	// count is the number of object ids used this frame
+	void begin_frame(size_t count)
+	{
+		stats = Stats();
+		if (objects.size() < count)
+			objects.resize(count);
+		for (auto& o : objects)
+		{
+			o.due = false;
+			if (!o.pending)
+				continue;
+			GLuint available = 0;
+			glGetQueryObjectuiv(o.query, GL_QUERY_RESULT_AVAILABLE, &available);
+			if (available)
+			{
+				GLuint samples = 0;
+				glGetQueryObjectuiv(o.query, GL_QUERY_RESULT, &samples);
+				o.visible = samples != 0;
+				o.pending = false;
+			}
+			else if (!o.visible && frame - o.tested_frame > 2)
+				o.visible = true; // the result is late, don't keep a possibly visible object hidden
+		}
+	}
+
+	// whether the object is drawn this frame, marks a test when one is due
+	bool visible(uint32_t id, const AABB& box, const vec3& camera)
+	{
+		if (!enabled || box.empty() || id >= objects.size())
+			return true;
+		auto& o = objects[id];
+		// an object that was skipped (e.g. outside the frustum) starts over as visible
+		if (o.seen_frame != frame - 1)
+			o.visible = true;
+		o.seen_frame = frame;
+
+		AABB grown;
+		grown.min = box.min - vec3(margin);
+		grown.max = box.max + vec3(margin);
+		if (all(greaterThanEqual(camera, grown.min)) && all(lessThanEqual(camera, grown.max)))
+		{
+			o.visible = true;
+			return true;
+		}
+		if (!o.pending && (!o.visible || (frame + id) % retest_interval == 0))
+		{
+			o.box = grown;
+			o.due = true;
+		}
+		return o.visible;
+	}
+
+	// after the shaded pass, with its depth buffer bound
+	void issue()
+	{
+		for (auto& o : objects)
+		{
+			if (o.seen_frame == frame && !o.visible)
+				stats.occluded++;
+			if (o.due)
+				stats.tested++;
+		}
+		if (stats.tested)
+		{
+			gl_state.color_mask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+			gl_state.depth_mask(GL_FALSE);
+			gl_state.disable(GL_CULL_FACE);
+			gl_state.use_program(program);
+			for (auto& o : objects)
+			{
+				if (!o.due)
+					continue;
+				if (!o.query)
+					glGenQueries(1, &o.query);
+				glUniform3fv(box_min_loc, 1, &o.box.min[0]);
+				glUniform3fv(box_max_loc, 1, &o.box.max[0]);
+				glBeginQuery(target, o.query);
+				glDrawArrays(GL_TRIANGLES, 0, 36);
+				glEndQuery(target);
+				o.pending = true;
+				o.tested_frame = frame;
+			}
+			gl_state.use_program(0);
+			gl_state.enable(GL_CULL_FACE);
+			gl_state.depth_mask(GL_TRUE);
+			gl_state.color_mask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		}
+		frame++;
+	}
+}occlusion;
+
+// collects triangles with the same normal/tex_coord/vertex calling pattern as glBegin(GL_TRIANGLES)
+struct MeshBuilder
+{
+	std::vector<Vertex> vertices;
+	std::vector<uint> indices;
+	Vertex current = {};
+
+	void normal(float x, float y, float z) { current.normal = vec3(x, y, z); }
+	void tex_coord(float u, float v) { current.uv = vec2(u, v); }
+	void vertex(float x, float y, float z)
+	{
+		current.position = vec3(x, y, z);
+		indices.push_back((uint)vertices.size());
+		vertices.push_back(current);
+	}
+
+	Mesh build() const
+	{
+		Mesh ret;
+		ret.create(vertices.data(), vertices.size(), indices.data(), indices.size());
+		for (auto& v : vertices)
+			ret.bounds.extend(v.position);
+		return ret;
+	}
+};
+
+void prism(MeshBuilder& b, float depth, float width, float height, float y_off = 0.f)
+{
+	auto hf_width = width * 0.5f;
+
+	b.normal(0.f, 0.f, 1.f);
+	b.tex_coord(0.f, 0.f);
+	b.vertex(0.f, 0.f + y_off, 0.f);
+	b.tex_coord(1.f, 0.f);
+	b.vertex(width, 0.f + y_off, 0.f);
+	b.tex_coord(0.f, 1.f);
+	b.vertex(hf_width, height + y_off, 0.f);
+
+	auto slop_normal1 = normalize(cross(vec3(0.f, 0.f, 1.f), vec3(hf_width, -height, 0.f)));
+	b.normal(slop_normal1.x, slop_normal1.y, slop_normal1.z);
+	b.tex_coord(0.f, 0.f);
+	b.vertex(hf_width, height + y_off, 0.f);
+	b.tex_coord(0.f, 1.f);
+	b.vertex(width, 0.f + y_off, 0.f);
+	b.tex_coord(1.f, 0.f);
+	b.vertex(hf_width, height + y_off, -depth);
+	b.tex_coord(1.f, 0.f);
+	b.vertex(hf_width, height + y_off, -depth);
+	b.tex_coord(0.f, 1.f);
+	b.vertex(width, 0.f + y_off, 0.f);
+	b.tex_coord(1.f, 1.f);
+	b.vertex(width, 0.f + y_off, -depth);
+
+	auto slop_normal2 = normalize(cross(vec3(0.f, 0.f, -1.f), vec3(-hf_width, -height, 0.f)));
+	b.normal(slop_normal2.x, slop_normal2.y, slop_normal2.z);
+	b.tex_coord(0.f, 0.f);
+	b.vertex(hf_width, height + y_off, -depth);
+	b.tex_coord(0.f, 1.f);
+	b.vertex(0.f, 0.f + y_off, -depth);
+	b.tex_coord(1.f, 0.f);
+	b.vertex(hf_width, height + y_off, 0.f);
+	b.tex_coord(1.f, 0.f);
+	b.vertex(hf_width, height + y_off, 0.f);
+	b.tex_coord(0.f, 1.f);
+	b.vertex(0.f, 0.f + y_off, -depth);
+	b.tex_coord(1.f, 1.f);
+	b.vertex(0.f, 0.f + y_off, 0.f);
+
+	b.normal(0.f, 0.f, -1.f);
+	b.tex_coord(0.f, 0.f);
+	b.vertex(0.f, 0.f + y_off, -depth);
+	b.tex_coord(0.f, 1.f);
+	b.vertex(hf_width, height + y_off, -depth);
+	b.tex_coord(1.f, 0.f);
+	b.vertex(width, 0.f + y_off, -depth);
+}
+
+// same layout as the old gluDisk/gluCylinder trio: back cap at z = 0, front cap at z = width
+void wheel(MeshBuilder& b, float radius, float width, int slices)
+{
+	auto rim = [&](int i) {
+		auto a = glm::two_pi<float>() * i / slices;
+		return vec2(sin(a), cos(a));
+	};
+	auto disk_uv = [](vec2 d) { return d * 0.5f + 0.5f; };
+
+	for (auto i = 0; i < slices; i++)
+	{
+		auto d0 = rim(i);
+		auto d1 = rim(i + 1);
+
+		// front cap
+		b.normal(0.f, 0.f, 1.f);
+		b.tex_coord(0.5f, 0.5f);
+		b.vertex(0.f, 0.f, width);
+		b.tex_coord(disk_uv(d1).x, disk_uv(d1).y);
+		b.vertex(d1.x * radius, d1.y * radius, width);
+		b.tex_coord(disk_uv(d0).x, disk_uv(d0).y);
+		b.vertex(d0.x * radius, d0.y * radius, width);
+
+		// back cap, mirrored in x like the disk that was rotated 180 degrees around y
+		b.normal(0.f, 0.f, -1.f);
+		b.tex_coord(0.5f, 0.5f);
+		b.vertex(0.f, 0.f, 0.f);
+		b.tex_coord(disk_uv(d1).x, disk_uv(d1).y);
+		b.vertex(-d1.x * radius, d1.y * radius, 0.f);
+		b.tex_coord(disk_uv(d0).x, disk_uv(d0).y);
+		b.vertex(-d0.x * radius, d0.y * radius, 0.f);
+
+		// side
+		auto s0 = (float)i / slices;
+		auto s1 = (float)(i + 1) / slices;
+		b.normal(d0.x, d0.y, 0.f);
+		b.tex_coord(s0, 0.f);
+		b.vertex(d0.x * radius, d0.y * radius, 0.f);
+		b.tex_coord(s0, 1.f);
+		b.vertex(d0.x * radius, d0.y * radius, width);
+		b.normal(d1.x, d1.y, 0.f);
+		b.tex_coord(s1, 1.f);
+		b.vertex(d1.x * radius, d1.y * radius, width);
+		b.normal(d0.x, d0.y, 0.f);
+		b.tex_coord(s0, 0.f);
+		b.vertex(d0.x * radius, d0.y * radius, 0.f);
+		b.normal(d1.x, d1.y, 0.f);
+		b.tex_coord(s1, 1.f);
+		b.vertex(d1.x * radius, d1.y * radius, width);
+		b.tex_coord(s1, 0.f);
+		b.vertex(d1.x * radius, d1.y * radius, 0.f);
+	}
+}
+
+enum class Shape
+{
+	Prism,
+	Wheel,
+};
+
+// procedural meshes are generated once per distinct parameter set and kept on the GPU
+struct ShapeCache
+{
+	std::map<std::tuple<Shape, float, float, float, float>, Mesh> meshes;
+
+	Mesh& prism(float depth, float width, float height, float y_off = 0.f)
+	{
+		auto key = std::make_tuple(Shape::Prism, depth, width, height, y_off);
+		auto it = meshes.find(key);
+		if (it != meshes.end())
+			return it->second;
+		MeshBuilder b;
+		::prism(b, depth, width, height, y_off);
+		return meshes[key] = b.build();
+	}
+
+	Mesh& wheel(float radius, float width, int slices)
+	{
+		auto key = std::make_tuple(Shape::Wheel, radius, width, (float)slices, 0.f);
+		auto it = meshes.find(key);
+		if (it != meshes.end())
+			return it->second;
+		MeshBuilder b;
+		::wheel(b, radius, width, slices);
+		return meshes[key] = b.build();
+	}
+
+	void clear()
+	{
+		for (auto& it : meshes)
+			it.second.destroy();
+		meshes.clear();
+	}
+}shapes;
+
+// switches toggled from the keyboard; owned by the main thread and handed to the
+// renderer with every snapshot
+struct Controls
+{
+	Shading shading = Shading::Forward;
+	DepthPrepass::Mode prepass = DepthPrepass::Auto;
+	bool occlusion = true;
+	bool profiler = true; // overlay window
+}controls;
+
+auto move = 0; // stand, forward, backward
+
+static GLFWkeyfun prev_keyfun = nullptr;
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+	if (prev_keyfun)
+		prev_keyfun(window, key, scancode, action, mods);
+	redraw.mark();
+	if (ImGui::GetIO().WantCaptureKeyboard)
+		return;
+	if (key == GLFW_KEY_W)
+	{
+		if (action == GLFW_PRESS)
+			camera.forward = true;
+		else if (action == GLFW_RELEASE)
+			camera.forward = false;
+	}
+	else if (key == GLFW_KEY_S)
+	{
+		if (action == GLFW_PRESS)
+			camera.backward = true;
+		else if (action == GLFW_RELEASE)
+			camera.backward = false;
+	}
+	else if (key == GLFW_KEY_A)
+	{
+		if (action == GLFW_PRESS)
+			camera.left = true;
+		else if (action == GLFW_RELEASE)
+			camera.left = false;
+	}
+	else if (key == GLFW_KEY_D)
+	{
+		if (action == GLFW_PRESS)
+			camera.right = true;
+		else if (action == GLFW_RELEASE)
+			camera.right = false;
+	}
+	else if (key == GLFW_KEY_SPACE)
+	{
+		if (action == GLFW_PRESS && move == 0)
+			move = 1;
+	}
+	else if (key == GLFW_KEY_P)
+	{
+		if (action == GLFW_PRESS)
+		{
+			controls.prepass = (DepthPrepass::Mode)((controls.prepass + 1) % 3);
+			printf("depth pre-pass %s\n", DepthPrepass::name(controls.prepass));
+		}
+	}
+	else if (key == GLFW_KEY_F1)
+	{
+		if (action == GLFW_PRESS)
+			controls.profiler = !controls.profiler;
+	}
+	else if (key == GLFW_KEY_F2)
+	{
+		if (action == GLFW_PRESS)
+		{
+			if (tracer.enabled)
+				tracer.stop(tracer.path);
+			else
+				tracer.begin();
+		}
+	}
+	else if (key == GLFW_KEY_O)
+	{
+		if (action == GLFW_PRESS)
+		{
+			controls.occlusion = !controls.occlusion;
+			printf("occlusion culling %s\n", controls.occlusion ? "on" : "off");
+		}
+	}
+	else if (key == GLFW_KEY_G)
+	{
+		if (action == GLFW_PRESS)
+		{
+			controls.shading = controls.shading == Shading::Forward ? Shading::Deferred : Shading::Forward;
+			printf("%s shading\n", controls.shading == Shading::Forward ? "forward" : "deferred");
+		}
+	}
+}
+
+bool dragging = false;
+double last_x = 0;
+double last_y = 0;
+
+static GLFWmousebuttonfun prev_mousebuttonfun = nullptr;
+void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
+{
+	if (prev_mousebuttonfun)
+		prev_mousebuttonfun(window, button, action, mods);
+	redraw.mark();
+	if (ImGui::GetIO().WantCaptureMouse)
+		return;
+	if (button == GLFW_MOUSE_BUTTON_LEFT)
+	{
+		if (action == GLFW_PRESS)
+		{
+			glfwGetCursorPos(window, &last_x, &last_y);
+			dragging = true;
+		}
+		else if (action == GLFW_RELEASE)
+			dragging = false;
+	}
+}
+
+static GLFWcursorposfun prev_cursorposfun = nullptr;
+void cursor_position_callback(GLFWwindow* window, double xpos, double ypos)
+{
+	if (prev_cursorposfun)
+		prev_cursorposfun(window, xpos, ypos);
+	redraw.mark();
+	if (ImGui::GetIO().WantCaptureMouse)
+		return;
+	if (dragging)
+	{
+		camera.x_angle -= xpos - last_x;
+		camera.y_angle -= ypos - last_y;
+		last_x = xpos;
+		last_y = ypos;
+	}
+}
+
+// wheel placement relative to the train origin
+const vec3 WHEEL_OFFSETS[] = {
+	vec3(-0.1f, 0.f, 0.f),
+	vec3(-0.1f, 0.f, -0.6f),
+	vec3(-0.1f, 0.f, -1.2f),
+	vec3(0.5f, 0.f, 0.f),
+	vec3(0.5f, 0.f, -0.6f),
+	vec3(0.5f, 0.f, -1.2f),
+};
+
+mat4 wheel_transform(const mat4& train_transform, const vec3& pos)
+{
+	return train_transform * translate(mat4(1.f), pos) * rotate(mat4(1.f), radians(90.f), vec3(0.f, 1.f, 0.f));
+}
+
+void append_wheels(std::vector<Instance>& instances, const mat4& train_transform, float phase)
+{
+	for (auto& pos : WHEEL_OFFSETS)
+	{
+		Instance inst;
+		inst.transform = wheel_transform(train_transform, pos);
+		inst.phase = phase;
+		instances.push_back(inst);
+	}
+}
+
+struct Train
+{
+	float x = 0.f;
+	float z = 0.f;
+	int move = 0; // stand, forward, backward
+	float wheel_angle = 0.f;
+	float prev_z = 0.f; // state before the last simulation step
+	float prev_wheel_angle = 0.f;
+
+	// alpha interpolates between the last two simulation steps
+	vec3 position(float alpha = 1.f) const { return vec3(x, 0.3f, mix(prev_z, z, alpha)); }
+	mat4 transform(float alpha = 1.f) const { return translate(mat4(1.f), position(alpha)); }
+	float angle(float alpha = 1.f) const { return mix(prev_wheel_angle, wheel_angle, alpha); }
+};
+
+// grid, trains and cows, generated from the command line so the same binary can be
+// used to see how the frame cost scales with object counts
+//   --grid X Y     grid cells (default 20 40), widened to fit the tracks
+//   --cell S       grid cell size (default 0.2)
+//   --trains M     trains on parallel tracks (default 1)
+//   --cows N       cows scattered over the grid (default 1)
+//   --lamps L      street lamps scattered over the grid (default 0)
+struct Scene
+{
+	uint grid_x = 20;
+	uint grid_y = 40;
+	float grid_s = 0.2f;
+	uint train_count = 1;
+	uint cow_count = 1;
+	uint lamp_count = 0;
+
+	static const uint FIRST_TRACK = 8; // grid column of the first track's left rail
+	static const uint TRACK_PITCH = 4; // grid columns between parallel tracks
+
+	float speed = 0.f; // units per second
+	std::vector<Train> trains;
+	std::vector<Instance> cows;
+	std::vector<PointLight> lamps;
+
+	void parse(int argc, char** argv)
+	{
+		for (auto i = 1; i < argc; i++)
+		{
+			if (!strcmp(argv[i], "--grid") && i + 2 < argc)
+			{
+				grid_x = std::max(1, atoi(argv[++i]));
+				grid_y = std::max(1, atoi(argv[++i]));
+			}
+			else if (!strcmp(argv[i], "--cell") && i + 1 < argc)
+				grid_s = std::max(0.01f, (float)atof(argv[++i]));
+			else if (!strcmp(argv[i], "--trains") && i + 1 < argc)
+				train_count = std::max(0, atoi(argv[++i]));
+			else if (!strcmp(argv[i], "--cows") && i + 1 < argc)
+				cow_count = std::max(0, atoi(argv[++i]));
+			else if (!strcmp(argv[i], "--lamps") && i + 1 < argc)
+				lamp_count = std::max(0, atoi(argv[++i]));
+		}
+	}
+
+	bool is_track(uint column) const
+	{
+		if (column < FIRST_TRACK)
+			return false;
+		auto i = (column - FIRST_TRACK) / TRACK_PITCH;
+		return i < train_count && (column - FIRST_TRACK) % TRACK_PITCH < 2;
+	}
+
+	vec2 offset() const { return vec2(grid_x, grid_y) * grid_s * -0.5f; }
+
+	void generate()
+	{
+		if (train_count)
+			grid_x = std::max(grid_x, FIRST_TRACK + (train_count - 1) * TRACK_PITCH + 4);
+		// the train is 1.5 long and turns around 1.5 before the far end
+		grid_y = std::max(grid_y, (uint)ceil(3.5f / grid_s));
+
+		speed = (grid_y * grid_s - 1.5f) / 10.f;
+		trains.resize(train_count);
+		for (auto i = 0U; i < train_count; i++)
+		{
+			trains[i].x = (grid_x * -0.5f + FIRST_TRACK + i * TRACK_PITCH) * grid_s - 0.15f;
+			trains[i].z = trains[i].prev_z = grid_y * 0.5f * grid_s;
+		}
+
+		// the first cow keeps its hand placed transform, the rest are scattered deterministically
+		auto cow_local = scale(mat4(1.f), vec3(0.1f));
+		cow_local = rotate(cow_local, radians(-90.f), vec3(1.f, 0.f, 0.f));
+		cow_local = translate(cow_local, vec3((grid_x * -0.5f + FIRST_TRACK) * grid_s, 0.f, (grid_y * 0.5f) * grid_s));
+		std::mt19937 rng(1);
+		std::uniform_real_distribution<float> rx(offset().x, -offset().x);
+		std::uniform_real_distribution<float> rz(offset().y, -offset().y);
+		std::uniform_real_distribution<float> ryaw(0.f, 360.f);
+		cows.resize(cow_count);
+		for (auto i = 0U; i < cow_count; i++)
+		{
+			cows[i].transform = cow_local;
+			cows[i].phase = 0.f;
+			if (i > 0)
+			{
+				auto pos = vec3(rx(rng), 0.f, rz(rng));
+				cows[i].transform = translate(mat4(1.f), pos) * rotate(mat4(1.f), radians(ryaw(rng)), vec3(0.f, 1.f, 0.f)) * cow_local;
+			}
+		}
+
+		// separate stream so lamps do not move the cows
+		std::mt19937 lamp_rng(2);
+		lamps.resize(lamp_count);
+		for (auto& l : lamps)
+		{
+			l.position = vec3(rx(lamp_rng), 0.6f, rz(lamp_rng));
+			l.radius = 1.5f;
+			l.color = vec3(1.0f, 0.85f, 0.6f);
+			l.intensity = 0.5f;
+		}
+	}
+
+	// moving trains need a frame every vsync
+	bool animating() const
+	{
+		for (auto& t : trains)
+		{
+			if (t.move != 0)
+				return true;
+		}
+		return move != 0 && !trains.empty();
+	}
+
+	// one fixed simulation step, the wheels turn 720 degrees per second
+	void step(float dt)
+	{
+		for (auto& t : trains)
+		{
+			t.prev_z = t.z;
+			t.prev_wheel_angle = t.wheel_angle;
+			if (t.move == 0 && move != 0)
+				t.move = 1;
+			if (t.move == 1)
+			{
+				t.z -= speed * dt;
+				if (t.z <= grid_y * -0.5f * grid_s + 1.5f)
+					t.move = 2;
+			}
+			else if (t.move == 2)
+			{
+				t.z += speed * dt;
+				if (t.z >= grid_y * 0.5f * grid_s)
+					t.move = 1;
+			}
+			if (t.move != 0)
+				t.wheel_angle += (t.move == 1 ? -720.f : 720.f) * dt;
+		}
+	}
+
+	// two headlights per train plus the lamps
+	void lights(std::vector<PointLight>& out, float alpha) const
+	{
+		out = lamps;
+		for (auto& t : trains)
+		{
+			auto pos = t.position(alpha);
+			for (auto x : { 0.15f, 0.35f })
+				out.push_back(PointLight{ pos + vec3(x, 0.55f, -1.6f), 10.f, vec3(1.0f, 0.77f, 0.56f), 10000.f });
+		}
+	}
+}scene;
+
+// fixed-timestep simulation: real frame time is accumulated and consumed in `step` sized
+// steps, at most max_steps per frame so a slow frame can't snowball into more work.
+// alpha is how far the render time is past the last step, the drawn state is
+// interpolated between the last two steps with it (one step of latency)
+struct SimClock
+{
+	double step = 1.0 / 60.0;
+	int max_steps = 5;
+	double accumulator = 0.0;
+	float alpha = 0.f;
+	std::chrono::steady_clock::time_point last;
+	bool started = false;
+
+	// the next frame_time() is one step, e.g. after the loop was idle
+	void reset() { started = false; }
+
+	// real time since the previous call, clamped so a stall (e.g. dragging the window) is dropped
+	double frame_time()
+	{
+		auto now = std::chrono::steady_clock::now();
+		auto dt = started ? std::chrono::duration<double>(now - last).count() : step;
+		last = now;
+		started = true;
+		return std::min(dt, 0.25);
+	}
+
+	// number of steps to run for dt
+	int advance(double dt)
+	{
+		accumulator += dt;
+		auto n = 0;
+		while (accumulator >= step && n < max_steps)
+		{
+			accumulator -= step;
+			n++;
+		}
+		if (accumulator >= step)
+			accumulator = fmod(accumulator, step);
+		alpha = (float)(accumulator / step);
+		return n;
+	}
+}sim_clock;
+
+// immediate mode lines through grid_program, which reads the fixed function matrices
+void draw_grid()
+{
+	glBegin(GL_LINES);
+	auto offset = scene.offset();
+	for (auto y = 0U; y < scene.grid_y + 1; y++)
+	{
+		glColor3f(0.78f, 0.88f, 0.80f);
+		glVertex3f(0.f + offset.x, 0.f, y * scene.grid_s + offset.y);
+		glVertex3f(scene.grid_x * scene.grid_s + offset.x, 0.f, y * scene.grid_s + offset.y);
+	}
+	for (auto x = 0U; x < scene.grid_x + 1; x++)
+	{
+		if (scene.is_track(x))
+			glColor3f(0.f, 0.f, 0.f);
+		else
+			glColor3f(0.78f, 0.88f, 0.80f);
+		glVertex3f(x * scene.grid_s + offset.x, 0.f, 0.f + offset.y);
+		glVertex3f(x * scene.grid_s + offset.x, 0.f, scene.grid_y * scene.grid_s + offset.y);
+	}
+	glEnd();
+}
+
+// --bench: fixed number of frames rendered into an offscreen framebuffer along a scripted
+// camera path, then per-frame CPU/GPU time statistics are written as JSON
+struct Bench
+{
+	bool enabled = false;
+	int frames = 1000;
+	int width = 800;
+	int height = 600;
+	const char* out_file = nullptr;
+	FILE* report_stream = nullptr; // the original stdout when there's no --out
+
+	int frame = 0;
+	GLuint fbo = 0;
+	GLuint color_rb = 0;
+	GLuint depth_rb = 0;
+	GLuint queries[4] = {};
+	std::chrono::steady_clock::time_point frame_start;
+	std::vector<double> cpu_ms;
+	std::vector<double> gpu_ms;
+#ifdef __linux__
+	EGLDisplay egl_display = EGL_NO_DISPLAY;
+	EGLContext egl_context = EGL_NO_CONTEXT;
+#endif
+
+	void parse(int argc, char** argv)
+	{
+		for (auto i = 1; i < argc; i++)
+		{
+			if (!strcmp(argv[i], "--bench"))
+				enabled = true;
+			else if (!strcmp(argv[i], "--frames") && i + 1 < argc)
+				frames = std::max(1, atoi(argv[++i]));
+			else if (!strcmp(argv[i], "--size") && i + 2 < argc)
+			{
+				width = std::max(1, atoi(argv[++i]));
+				height = std::max(1, atoi(argv[++i]));
+			}
+			else if (!strcmp(argv[i], "--out") && i + 1 < argc)
+				out_file = argv[++i];
+		}
+		if (enabled && !out_file)
+			claim_stdout();
+	}
+
+	// without --out the report is the only output on stdout: it keeps the original stream and
+	// everything else printed during the run (diagnostics, assimp, the driver) goes to stderr
+	void claim_stdout()
+	{
+		fflush(stdout);
+#ifdef _WIN32
+		report_stream = _fdopen(_dup(_fileno(stdout)), "w");
+		_dup2(_fileno(stderr), _fileno(stdout));
+#else
+		report_stream = fdopen(dup(fileno(stdout)), "w");
+		dup2(fileno(stderr), fileno(stdout));
+#endif
+	}
+
+	// prefers a surfaceless EGL context so the bench needs no display server, falls back to a
+	// hidden GLFW window where EGL has no desktop GL
+	bool create_context()
+	{
+#ifdef __linux__
+		if (create_egl_context())
+			return true;
+#endif
+		if (!glfwInit())
+		{
+			printf("cannot create a GL context for the bench\n");
+			return false;
+		}
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+		window = glfwCreateWindow(width, height, "", nullptr, nullptr);
+		if (!window)
+		{
+			printf("cannot create a GL context for the bench\n");
+			return false;
+		}
+		glfwMakeContextCurrent(window);
+		glfwSwapInterval(0);
+		return true;
+	}
+
+#ifdef __linux__
+	bool create_egl_context()
+	{
+		auto get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+		egl_display = get_platform_display ?
+			get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr) :
+			eglGetDisplay(EGL_DEFAULT_DISPLAY);
+		EGLint major, minor;
+		if (egl_display == EGL_NO_DISPLAY || !eglInitialize(egl_display, &major, &minor))
+		{
+			egl_display = EGL_NO_DISPLAY;
+			return false;
+		}
+		const EGLint config_attribs[] = {
+			EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+			EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+			EGL_NONE
+		};
+		const EGLint context_attribs[] = {
+			EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+			EGL_NONE
+		};
+		EGLConfig config;
+		EGLint config_count = 0;
+		if (eglBindAPI(EGL_OPENGL_API) &&
+			eglChooseConfig(egl_display, config_attribs, &config, 1, &config_count) && config_count > 0)
+			egl_context = eglCreateContext(egl_display, config, EGL_NO_CONTEXT, context_attribs);
+		if (egl_context != EGL_NO_CONTEXT && eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, egl_context))
+			return true;
+		// leave nothing behind for the GLFW fallback
+		if (egl_context != EGL_NO_CONTEXT)
+			eglDestroyContext(egl_display, egl_context);
+		eglTerminate(egl_display);
+		egl_context = EGL_NO_CONTEXT;
+		egl_display = EGL_NO_DISPLAY;
+		return false;
+	}
+#endif
+
+	void create_target()
+	{
+		glGenRenderbuffers(1, &color_rb);
+		glBindRenderbuffer(GL_RENDERBUFFER, color_rb);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+		glGenRenderbuffers(1, &depth_rb);
+		glBindRenderbuffer(GL_RENDERBUFFER, depth_rb);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+		glGenFramebuffers(1, &fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color_rb);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth_rb);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			printf("bench framebuffer incomplete\n");
+		glGenQueries((GLsizei)size(queries), queries);
+		cpu_ms.reserve(frames);
+		gpu_ms.reserve(frames);
+	}
+
+	bool running() const { return frame < frames; }
+
+	// orbits the scene once over the run, always looking at the origin; f is the frame
+	// the main thread is simulating, frame counts the ones the renderer finished
+	void script_camera(Camera& cam, int f) const
+	{
+		auto t = (float)f / frames;
+		auto a = t * 360.f;
+		auto r = std::max(6.f, std::max(scene.grid_x, scene.grid_y) * scene.grid_s * 0.6f);
+		auto h = r / 3.f;
+		cam.coord = vec3(sin(radians(a)) * r, h, cos(radians(a)) * r);
+		cam.x_angle = a;
+		cam.y_angle = -degrees(atan(h / r));
+	}
+
+	void read_query(int i)
+	{
+		GLuint64 ns = 0;
+		glGetQueryObjectui64v(queries[i % size(queries)], GL_QUERY_RESULT, &ns);
+		gpu_ms.push_back(ns * 1e-6);
+	}
+
+	void begin_frame()
+	{
+		frame_start = std::chrono::steady_clock::now();
+		// results lag by size(queries) frames so the read normally doesn't wait on the GPU
+		if (frame >= (int)size(queries))
+			read_query(frame - size(queries));
+		glBeginQuery(GL_TIME_ELAPSED, queries[frame % size(queries)]);
+	}
+
+	void end_frame()
+	{
+		glEndQuery(GL_TIME_ELAPSED);
+		glFlush();
+		cpu_ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frame_start).count());
+		frame++;
+	}
+
+	static void write_stats(FILE* fp, const char* name, std::vector<double> v)
+	{
+		std::sort(v.begin(), v.end());
+		auto mean = 0.0;
+		for (auto x : v)
+			mean += x;
+		mean = v.empty() ? 0.0 : mean / v.size();
+		auto pct = [&](double p) { return v.empty() ? 0.0 : v[(size_t)(p * (v.size() - 1) + 0.5)]; };
+		fprintf(fp, "\"%s\": {\"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f}",
+			name, mean, pct(0.5), pct(0.95), pct(0.99));
+	}
+
+	void report()
+	{
+		for (auto i = std::max(0, frame - (int)size(queries)); i < frame; i++)
+			read_query(i);
+
+		auto fp = out_file ? fopen(out_file, "w") : report_stream ? report_stream : stdout;
+		if (!fp)
+		{
+			printf("cannot open %s\n", out_file);
+			return;
+		}
+		auto renderer = (const char*)glGetString(GL_RENDERER);
+		fprintf(fp, "{\"frames\": %d, \"width\": %d, \"height\": %d,\n", frame, width, height);
+		fprintf(fp, "\"renderer\": ");
+		write_json_string(fp, renderer ? renderer : "unknown");
+		fprintf(fp, ",\n");
+		write_stats(fp, "cpu_ms", cpu_ms);
+		fprintf(fp, ",\n");
+		write_stats(fp, "gpu_ms", gpu_ms);
+		fprintf(fp, "}\n");
+		if (fp != stdout)
+			fclose(fp);
+		report_stream = nullptr;
+	}
+
+	void destroy()
+	{
+		glDeleteQueries((GLsizei)size(queries), queries);
+		glDeleteFramebuffers(1, &fbo);
+		glDeleteRenderbuffers(1, &color_rb);
+		glDeleteRenderbuffers(1, &depth_rb);
+#ifdef __linux__
+		if (egl_context != EGL_NO_CONTEXT)
+		{
+			eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+			eglDestroyContext(egl_display, egl_context);
+			eglTerminate(egl_display);
+			egl_context = EGL_NO_CONTEXT;
+		}
+#endif
+	}
+}bench;
+
+// the render thread owns the GL context, which is created current on the main thread
+void set_context_current(bool current)
+{
+	if (window)
+		glfwMakeContextCurrent(current ? window : nullptr);
+#ifdef __linux__
+	else if (bench.egl_context != EGL_NO_CONTEXT)
+	{
+		// the bound client API is per thread
+		eglBindAPI(EGL_OPENGL_API);
+		eglMakeCurrent(bench.egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, current ? bench.egl_context : EGL_NO_CONTEXT);
+	}
+#endif
+}
+
+// copy of ImGui's draw data, so the render thread can draw it while the main thread
+// already builds the next ImGui frame
+struct UiFrame
+{
+	ImDrawData data;
+	std::vector<ImDrawList*> lists;
+
+	UiFrame() = default;
+	UiFrame(const UiFrame&) = delete;
+	UiFrame& operator=(const UiFrame&) = delete;
+	~UiFrame() { clear(); }
+
+	// main thread, clones go through ImGui's allocator
+	void capture(const ImDrawData* src)
+	{
+		clear();
+		for (auto i = 0; i < src->CmdListsCount; i++)
+			lists.push_back(src->CmdLists[i]->CloneOutput());
+		data = *src;
+		data.CmdLists = lists.data();
+	}
+
+	void clear()
+	{
+		for (auto l : lists)
+			IM_DELETE(l);
+		lists.clear();
+		data.Clear();
+	}
+};
+
+// everything the renderer needs of one simulated frame, filled on the main thread
+struct Snapshot
+{
+	int width = 0;
+	int height = 0;
+	mat4 view;
+	vec3 camera_coord;
+	float alpha = 0.f;
+	std::vector<Train> trains;
+	std::vector<PointLight> lights;
+	Controls controls;
+	UiFrame ui;
+};
+
+// render thread results shown in the overlay, copied out after every rendered frame
+struct FrameReport
+{
+	Profiler::Summary profiler;
+	bool deferred = false;
+	const char* prepass = "";
+	bool prepass_active = false;
+	float overdraw = 1.f;
+	RenderQueue::Stats queue;
+	OcclusionCuller::Stats occlusion;
+	RingBuffer::Stats ring;
+	size_t lights = 0;
+	GLState::Stats gl;
+};
+
+// triple buffer between the main thread (input, simulation, UI) and the render thread:
+// the main thread always has a slot of its own to fill and never waits on the GPU, the
+// render thread takes the newest published snapshot and skips the ones it was too slow for
+struct FrameHandoff
+{
+	Snapshot slots[3];
+	int write = 0;
+	int ready = 1;
+	int read = 2;
+	bool fresh = false; // ready hasn't been taken yet
+	bool waiting = false; // main thread is in wait_taken()
+	bool quit = false;
+	int started = 0; // -1 failed, 1 the renderer is set up
+	uint64_t published = 0;
+	uint64_t rendered = 0;
+	FrameReport report;
+	std::mutex mutex;
+	std::condition_variable cv;
+
+	// main thread
+	Snapshot& next() { return slots[write]; }
+
+	void publish()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			std::swap(write, ready);
+			fresh = true;
+			published++;
+		}
+		cv.notify_all();
+	}
+
+	// false if nothing is pending, otherwise returns once the renderer took it, an event
+	// arrived or after timeout seconds
+	bool wait_taken(double timeout)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!fresh)
+				return false;
+			waiting = true;
+		}
+		glfwWaitEventsTimeout(timeout);
+		std::lock_guard<std::mutex> lock(mutex);
+		waiting = false;
+		return true;
+	}
+
+	// lockstep for the bench: returns when everything published was rendered
+	void wait_rendered()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [this]() { return rendered == published || quit; });
+	}
+
+	bool wait_started()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [this]() { return started != 0; });
+		return started > 0;
+	}
+
+	void latest_report(FrameReport& out)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		out = report;
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		cv.notify_all();
+	}
+
+	// render thread
+	void set_started(bool ok)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			started = ok ? 1 : -1;
+			quit |= !ok;
+		}
+		cv.notify_all();
+	}
+
+	// blocks until there's a new snapshot, nullptr once stopped
+	Snapshot* take()
+	{
+		auto wake = false;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [this]() { return fresh || quit; });
+			if (quit)
+				return nullptr;
+			std::swap(read, ready);
+			fresh = false;
+			wake = waiting;
+			waiting = false;
+		}
+		if (wake)
+			glfwPostEmptyEvent();
+		return &slots[read];
+	}
+
+	void finish(const FrameReport& r)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			report = r;
+			rendered++;
+		}
+		cv.notify_all();
+	}
+};
+
+// main thread, from the latest report the renderer handed back
+void draw_overlay(const FrameReport& r)
+{
+	if (!controls.profiler)
+		return;
+	if (ImGui::Begin("Profiler (F1)", &controls.profiler))
+	{
+		r.profiler.draw_ui();
+		ImGui::Separator();
+		ImGui::Text("%s shading, pre-pass %s%s, overdraw %.2f", r.deferred ? "deferred" : "forward",
+			r.prepass, r.prepass_active ? " (active)" : "", r.overdraw);
+		ImGui::Text("queue: %u draws, %u programs, %u textures, %u meshes", r.queue.draws,
+			r.queue.program_binds, r.queue.texture_binds, r.queue.mesh_binds);
+		ImGui::Text("occlusion: %u tested, %u occluded", r.occlusion.tested, r.occlusion.occluded);
+		ImGui::Text("ring: %zu bytes, %u waits, %zu lights", r.ring.bytes, r.ring.waits, r.lights);
+		ImGui::Text("gl state: %u calls issued, %u redundant skipped", r.gl.issued, r.gl.redundant);
+	}
+	ImGui::End();
+}
+
+// render thread: owns the GL context and draws the snapshots the main thread publishes
+void render_main(FrameHandoff& handoff)
+{
+	tracer.name_thread("render");
+	set_context_current(true);
+
+	// without a GLX display (surfaceless EGL) glew still loads the GL entry points
+	auto glew_err = glewInit();
+	if (glew_err != GLEW_OK && !(bench.enabled && !window && glew_err == GLEW_ERROR_NO_GLX_DISPLAY))
+	{
+		printf("glew init failed\n");
+		set_context_current(false);
+		handoff.set_started(false);
+		return;
+	}
+
+	// draws use the placeholders (an empty mesh, a white texture) until the loads complete
+	loader.start();
+	pool.start();
+	std::vector<DrawList> draw_lists(pool.size());
+	std::vector<std::vector<Instance>> wheel_lists(pool.size());
+	loader.load_model(cow, "cow.obj", nullptr);
+	auto placeholder_texture = create_placeholder_texture();
+	auto body_texture = placeholder_texture;
+	auto wheel_texture = placeholder_texture;
+	loader.load_texture(body_texture, "scrap.jpg");
+	loader.load_texture(wheel_texture, "wheels.jpg");
+
+	if (bench.enabled)
+	{
+		// deterministic run: everything is loaded up front
+		bench.create_target();
+		while (!loader.idle())
+		{
+			loader.pump();
+			std::this_thread::yield();
+		}
+	}
+	else
+	{
+		// the font texture is built here, the main thread only starts ImGui frames after set_started
+		ImGui_ImplOpenGL2_Init();
+		ImGui_ImplOpenGL2_CreateDeviceObjects();
+	}
+
+	// positions must match bit for bit between the depth pre-pass and the shaded pass
+	const auto grid_vertex_source =
 		"#version 120\n"
+		"invariant gl_Position;\n"
 		"void main() {\n"
 		"	gl_FrontColor = gl_Color;\n"
 		"	gl_Position = gl_ProjectionMatrix * gl_ModelViewMatrix * gl_Vertex;\n"
-		"}"), 
-		create_shader(GL_FRAGMENT_SHADER, 
+		"}";
+	auto grid_program = load_program(grid_vertex_source,
 		"#version 120\n"
 		"void main() {\n"
 		"	gl_FragColor = gl_Color;\n"
-		"}"));
-	auto object_program = create_program(
-		create_shader(GL_VERTEX_SHADER,
-			"#version 130\n"
-			"uniform mat4 proj_mat;\n"
-			"uniform mat4 view_mat;\n"
-			"uniform mat4 model_mat;\n"
-			"uniform mat3 normal_mat;\n"
-			"uniform vec3 camera_coord;\n"
-			"varying vec2 uv;\n"
-			"varying vec3 normal;\n"
-			"varying vec3 coord;\n"
-			"varying vec3 view;\n"
-			"void main() {\n"
-			"	uv = gl_MultiTexCoord0.xy;\n"
-			"	normal = normalize(normal_mat * gl_Normal);\n"
-			"	coord = vec3(model_mat * gl_Vertex);\n"
-			"	view = normalize(coord - camera_coord);\n"
-			"	gl_Position = proj_mat * view_mat * model_mat * gl_Vertex;\n"
-			"}"),
-		create_shader(GL_FRAGMENT_SHADER,
-			"#version 130\n"
-			"uniform sampler2D tex;\n"
-			"uniform vec3 point_light1;\n"
-			"uniform vec3 point_light2;\n"
-			"varying vec2 uv;\n"
-			"varying vec3 normal;\n"
-			"varying vec3 coord;\n"
-			"varying vec3 view;\n"
-			"vec3 lighting(vec3 L, vec3 N, vec3 V, vec3 color, vec3 albedo) {\n"
-			"	vec3 R = reflect(L, N);\n"
-			"	float nl = max(0, dot(N, L));\n"
-			"	vec3 diff = albedo * nl * 0.5;\n"
-			"	float spec = pow(max(dot(R, V), 0.0), 8.0) * 0.5;\n"
-			"	return diff + vec3(spec);\n"
-			"}\n"
-			"vec3 point_lighting(vec3 p, vec3 albedo) {\n"
-			"	vec3 L = p - coord;\n"
-			"	float d = length(L);\n"
-			"	float a = 10000.0 / (d * d);\n"
-			"	L = normalize(L);\n"
-			"	return lighting(L, normal, view, vec3(1.0, 0.77, 0.56) * a, albedo);\n"
-			"}\n"
-			"void main() {\n"
-			"	vec3 albedo = texture(tex, uv).rgb;\n"
-			"	vec3 color = vec3(0.0);\n"
-			"	color += albedo * vec3(0.788, 0.88, 1.0) * 0.2; // ambient\n"
-			"	color += lighting(vec3(0, 1, 0), normal, view, vec3(0.788, 0.88, 1.0), albedo); // directional light\n"
-			"	color += point_lighting(point_light1, albedo); // point light1\n"
-			"	color += point_lighting(point_light2, albedo); // point light2\n"
-			"	gl_FragColor = vec4(color, 1.0);\n"
-			"}"));
-	auto proj_mat_id = glGetUniformLocation(object_program, "proj_mat");
-	auto view_mat_id = glGetUniformLocation(object_program, "view_mat");
-	auto model_mat_id = glGetUniformLocation(object_program, "model_mat");
-	auto normal_mat_id = glGetUniformLocation(object_program, "normal_mat");
-	auto camera_coord_id = glGetUniformLocation(object_program, "camera_coord");
-	auto light1_id = glGetUniformLocation(object_program, "point_light1");
-	auto light2_id = glGetUniformLocation(object_program, "point_light2");
-
-	auto quadrics = gluNewQuadric();
-	gluQuadricTexture(quadrics, GL_TRUE);
-	gluQuadricNormals(quadrics, GLU_SMOOTH);
-
-	auto body_texture = load_texture("scrap.jpg");
-	auto wheel_texture = load_texture("wheels.jpg");
-
-	auto speed = (GRIDY * GRIDS - 1.5f) / 10.f / 60.f;
-	auto train_z = GRIDY * 0.5f * GRIDS;
-
-	while (!glfwWindowShouldClose(window))
-	{
-		glfwPollEvents();
-
-		//ImGui_ImplOpenGL2_NewFrame();
-		//ImGui_ImplGlfw_NewFrame();
-		//ImGui::NewFrame();
-
-		int win_width;
-		int win_height;
-		glfwGetWindowSize(window, &win_width, &win_height);
+		"}");
+	// the grid is unlit, it goes into the g-buffer with a zero normal
+	auto grid_gbuffer_program = load_program(grid_vertex_source,
+		"#version 120\n"
+		"void main() {\n"
+		"	gl_FragData[0] = gl_Color;\n"
+		"	gl_FragData[1] = vec4(0.0);\n"
+		"}");
+	auto grid_depth_program = load_program(grid_vertex_source,
+		"#version 120\n"
+		"void main() {\n"
+		"}");
+	// GLSL 1.30 plus uniform blocks; every object program starts with these two
+	const auto shader_header =
+		"#version 130\n"
+		"#extension GL_ARB_uniform_buffer_object : require\n";
+	auto frame_block_source = std::string(
+		"#define CLUSTER_X ") + std::to_string(CLUSTER_X) + "\n"
+		"#define CLUSTER_Y " + std::to_string(CLUSTER_Y) + "\n"
+		"#define CLUSTER_Z " + std::to_string(CLUSTER_Z) + "\n"
+		"#define LIGHT_TEXTURE_WIDTH " + std::to_string(LIGHT_TEXTURE_WIDTH) + "\n"
+		"layout(std140) uniform Frame {\n"
+		"	mat4 proj_mat;\n"
+		"	mat4 view_mat;\n"
+		"	vec3 camera_coord;\n"
+		"	vec4 cluster_params;\n"
+		"	mat4 inv_view_proj;\n"
+		"};\n";
+	// shared by the forward object shaders and the deferred lighting passes
+	const auto lighting_source =
+		"uniform sampler2D light_data;\n"
+		"vec3 lighting(vec3 L, vec3 N, vec3 V, vec3 color, vec3 albedo) {\n"
+		"	vec3 R = reflect(L, N);\n"
+		"	float nl = max(0, dot(N, L));\n"
+		"	vec3 diff = albedo * nl * 0.5;\n"
+		"	float spec = pow(max(dot(R, V), 0.0), 8.0) * 0.5;\n"
+		"	return diff + vec3(spec);\n"
+		"}\n"
+		"vec3 ambient_lighting(vec3 N, vec3 V, vec3 albedo) {\n"
+		"	vec3 color = albedo * vec3(0.788, 0.88, 1.0) * 0.2; // ambient\n"
+		"	return color + lighting(vec3(0, 1, 0), N, V, vec3(0.788, 0.88, 1.0), albedo); // directional light\n"
+		"}\n"
+		"ivec2 light_texel(int i) {\n"
+		"	return ivec2(i % LIGHT_TEXTURE_WIDTH, i / LIGHT_TEXTURE_WIDTH);\n"
+		"}\n"
+		"vec3 point_lighting(int i, vec3 P, vec3 N, vec3 V, vec3 albedo) {\n"
+		"	vec4 p = texelFetch(light_data, light_texel(i * 2), 0);\n"
+		"	vec3 c = texelFetch(light_data, light_texel(i * 2 + 1), 0).rgb;\n"
+		"	vec3 L = p.xyz - P;\n"
+		"	float d = length(L);\n"
+		"	float w = clamp(1.0 - pow(d / p.w, 4.0), 0.0, 1.0); // fades to 0 at the radius\n"
+		"	float a = w * w / (d * d);\n"
+		"	L = normalize(L);\n"
+		"	return lighting(L, N, V, c * a, albedo);\n"
+		"}\n";
+	const auto object_fragment_source =
+		"uniform sampler2D tex;\n"
+		"uniform usampler2D light_clusters;\n"
+		"uniform usampler2D light_indices;\n"
+		"varying vec2 uv;\n"
+		"varying vec3 normal;\n"
+		"varying vec3 coord;\n"
+		"varying vec3 view;\n"
+		"#ifdef INSTANCED\n"
+		"varying vec4 tint;\n"
+		"#endif\n"
+		"void main() {\n"
+		"	vec3 albedo = texture(tex, uv).rgb;\n"
+		"#ifdef INSTANCED\n"
+		"	albedo *= tint.rgb;\n"
+		"#endif\n"
+		"#ifdef GBUFFER\n"
+		"	gl_FragData[0] = vec4(albedo, 1.0);\n"
+		"	gl_FragData[1] = vec4(normalize(normal), 1.0);\n"
+		"#else\n"
+		"	vec3 color = ambient_lighting(normal, view, albedo);\n"
+		"	float depth = -(view_mat * vec4(coord, 1.0)).z;\n"
+		"	ivec2 tile = min(ivec2(gl_FragCoord.xy * cluster_params.xy), ivec2(CLUSTER_X - 1, CLUSTER_Y - 1));\n"
+		"	int slice = clamp(int((log(depth) - cluster_params.w) * cluster_params.z), 0, CLUSTER_Z - 1);\n"
+		"	uvec2 cluster = texelFetch(light_clusters, ivec2(tile.y * CLUSTER_X + tile.x, slice), 0).xy;\n"
+		"	for (uint k = 0u; k < cluster.y; k++)\n"
+		"		color += point_lighting(int(texelFetch(light_indices, light_texel(int(cluster.x + k)), 0).r), coord, normal, view, albedo);\n"
+		"	gl_FragColor = vec4(color, 1.0);\n"
+		"#endif\n"
+		"}";
+	// shared by object_program and crowd_program, which defines INSTANCED and,
+	// with --compact, COMPACT_VERTEX; instanced transforms must be uniformly scaled
+	const auto object_vertex_source =
+		"invariant gl_Position;\n"
+		"#ifdef INSTANCED\n"
+		"attribute mat4 instance_mat;\n"
+		"attribute vec4 instance_tint;\n"
+		"varying vec4 tint;\n"
+		"#else\n"
+		"layout(std140) uniform Draw {\n"
+		"	mat4 model_mat;\n"
+		"	mat3 normal_mat;\n"
+		"};\n"
+		"#endif\n"
+		"varying vec2 uv;\n"
+		"varying vec3 normal;\n"
+		"varying vec3 coord;\n"
+		"varying vec3 view;\n"
+		"#ifdef COMPACT_VERTEX\n"
+		"attribute vec3 position_q;\n"
+		"attribute vec2 normal_oct;\n"
+		"attribute vec2 uv_h;\n"
+		"uniform vec3 position_offset;\n"
+		"uniform vec3 position_scale;\n"
+		"vec3 decode_octahedral(vec2 e) {\n"
+		"	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));\n"
+		"	if (n.z < 0.0)\n"
+		"		n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);\n"
+		"	return normalize(n);\n"
+		"}\n"
+		"#endif\n"
+		"void main() {\n"
+		"#ifdef INSTANCED\n"
+		"	mat4 model_mat = instance_mat;\n"
+		"	mat3 normal_mat = mat3(instance_mat);\n"
+		"	tint = instance_tint;\n"
+		"#endif\n"
+		"#ifdef COMPACT_VERTEX\n"
+		"	vec4 position = vec4(position_offset + position_q * position_scale, 1.0);\n"
+		"	vec3 in_normal = decode_octahedral(normal_oct);\n"
+		"	uv = uv_h;\n"
+		"#else\n"
+		"	vec4 position = gl_Vertex;\n"
+		"	vec3 in_normal = gl_Normal;\n"
+		"	uv = gl_MultiTexCoord0.xy;\n"
+		"#endif\n"
+		"	normal = normalize(normal_mat * in_normal);\n"
+		"	coord = vec3(model_mat * position);\n"
+		"	view = normalize(coord - camera_coord);\n"
+		"	gl_Position = proj_mat * view_mat * model_mat * position;\n"
+		"}";
+
+	Crowd cows;
+	cows.init(cow);
+	for (auto& c : scene.cows)
+		cows.add(c);
+
+	// wheels are drawn instanced; the model matrix comes from instance attributes and
+	// the spin is applied in the shader, normals use mat3(model) since the transforms are rigid
+	const auto wheel_vertex_source =
+		"invariant gl_Position;\n"
+		"attribute mat4 instance_mat;\n"
+		"attribute float instance_phase;\n"
+		"varying vec2 uv;\n"
+		"varying vec3 normal;\n"
+		"varying vec3 coord;\n"
+		"varying vec3 view;\n"
+		"void main() {\n"
+		"	float c = cos(instance_phase);\n"
+		"	float s = sin(instance_phase);\n"
+		"	mat4 model_mat = instance_mat * mat4(c, s, 0, 0, -s, c, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1);\n"
+		"	uv = gl_MultiTexCoord0.xy;\n"
+		"	normal = normalize(mat3(model_mat) * gl_Normal);\n"
+		"	coord = vec3(model_mat * gl_Vertex);\n"
+		"	view = normalize(coord - camera_coord);\n"
+		"	gl_Position = proj_mat * view_mat * model_mat * gl_Vertex;\n"
+		"}";
+
+	// [0] forward, [1] writes the g-buffer (GBUFFER), [2] depth only for the pre-pass;
+	// cows are drawn as one instanced crowd, in the compact layout when --compact is on
+	const auto depth_fragment_source = "void main() {\n}";
+	GLuint object_program[3];
+	GLuint crowd_program[3];
+	GLuint wheel_program[3];
+	for (auto variant = 0; variant < 3; variant++)
+	{
+		auto defines = std::string(shader_header) + (variant == 1 ? "#define GBUFFER\n" : "");
+		auto fragment_source = variant == 2 ? depth_fragment_source : object_fragment_source;
+		object_program[variant] = load_program(
+			defines + frame_block_source + object_vertex_source,
+			defines + frame_block_source + lighting_source + fragment_source);
+
+		auto crowd_defines = defines + "#define INSTANCED\n";
+		if (compact_vertices)
+			crowd_defines += "#define COMPACT_VERTEX\n";
+		crowd_defines += frame_block_source;
+		crowd_program[variant] = load_program(
+			crowd_defines + object_vertex_source,
+			crowd_defines + lighting_source + fragment_source,
+			{ { ATTRIB_POSITION_Q, "position_q" }, { ATTRIB_NORMAL_OCT, "normal_oct" }, { ATTRIB_UV_H, "uv_h" },
+			  { ATTRIB_INSTANCE_MAT, "instance_mat" }, { ATTRIB_INSTANCE_TINT, "instance_tint" } });
+
+		wheel_program[variant] = load_program(
+			defines + frame_block_source + wheel_vertex_source,
+			defines + frame_block_source + lighting_source + fragment_source,
+			{ { ATTRIB_INSTANCE_MAT, "instance_mat" }, { ATTRIB_INSTANCE_PHASE, "instance_phase" } });
+	}
+
+	// 36 vertices of an outward facing unit cube, corners in [0, 1]
+	const auto cube_source =
+		"const int cube[36] = int[36](0, 4, 6, 0, 6, 2, 1, 3, 7, 1, 7, 5, 0, 1, 5, 0, 5, 4,\n"
+		"	2, 6, 7, 2, 7, 3, 0, 2, 3, 0, 3, 1, 4, 5, 7, 4, 7, 6);\n"
+		"vec3 cube_corner(int v) {\n"
+		"	int c = cube[v];\n"
+		"	return vec3(c & 1, (c >> 1) & 1, (c >> 2) & 1);\n"
+		"}\n";
+	// deferred lighting: a full screen triangle for ambient + directional light, and a
+	// box around each point light generated from gl_VertexID / gl_InstanceID
+	const auto gbuffer_source =
+		"uniform sampler2D gbuffer_albedo;\n"
+		"uniform sampler2D gbuffer_normal;\n"
+		"uniform sampler2D gbuffer_depth;\n"
+		"vec3 gbuffer_position(ivec2 p) {\n"
+		"	vec2 size = vec2(textureSize(gbuffer_depth, 0));\n"
+		"	vec3 ndc = vec3(gl_FragCoord.xy / size, texelFetch(gbuffer_depth, p, 0).r) * 2.0 - 1.0;\n"
+		"	vec4 w = inv_view_proj * vec4(ndc, 1.0);\n"
+		"	return w.xyz / w.w;\n"
+		"}\n";
+	auto ambient_program = load_program(
+		std::string(shader_header) +
+		"void main() {\n"
+		"	gl_Position = vec4(float(gl_VertexID & 1) * 4.0 - 1.0, float(gl_VertexID >> 1) * 4.0 - 1.0, 0.0, 1.0);\n"
+		"}",
+		std::string(shader_header) + frame_block_source + lighting_source + gbuffer_source +
+		"void main() {\n"
+		"	ivec2 p = ivec2(gl_FragCoord.xy);\n"
+		"	vec3 albedo = texelFetch(gbuffer_albedo, p, 0).rgb;\n"
+		"	vec4 n = texelFetch(gbuffer_normal, p, 0);\n"
+		"	if (n.w == 0.0) {\n"
+		"		gl_FragColor = vec4(albedo, 1.0);\n"
+		"		return;\n"
+		"	}\n"
+		"	vec3 P = gbuffer_position(p);\n"
+		"	gl_FragColor = vec4(ambient_lighting(n.xyz, normalize(P - camera_coord), albedo), 1.0);\n"
+		"}");
+	auto point_light_program = load_program(
+		std::string(shader_header) + frame_block_source + lighting_source + cube_source +
+		"flat out int light;\n"
+		"void main() {\n"
+		"	light = gl_InstanceID;\n"
+		"	vec4 p = texelFetch(light_data, light_texel(light * 2), 0);\n"
+		"	vec3 corner = cube_corner(gl_VertexID) * 2.0 - 1.0;\n"
+		"	gl_Position = proj_mat * view_mat * vec4(p.xyz + corner * p.w, 1.0);\n"
+		"}",
+		std::string(shader_header) + frame_block_source + lighting_source + gbuffer_source +
+		"flat in int light;\n"
+		"void main() {\n"
+		"	ivec2 p = ivec2(gl_FragCoord.xy);\n"
+		"	vec4 n = texelFetch(gbuffer_normal, p, 0);\n"
+		"	if (n.w == 0.0)\n"
+		"		discard;\n"
+		"	vec3 albedo = texelFetch(gbuffer_albedo, p, 0).rgb;\n"
+		"	vec3 P = gbuffer_position(p);\n"
+		"	gl_FragColor = vec4(point_lighting(light, P, n.xyz, normalize(P - camera_coord), albedo), 1.0);\n"
+		"}");
+	// binds the sampler units and uniform blocks
+	reflect_program(ambient_program);
+	reflect_program(point_light_program);
+
+	auto occlusion_program = load_program(
+		std::string(shader_header) + frame_block_source + cube_source +
+		"uniform vec3 box_min;\n"
+		"uniform vec3 box_max;\n"
+		"void main() {\n"
+		"	gl_Position = proj_mat * view_mat * vec4(mix(box_min, box_max, cube_corner(gl_VertexID)), 1.0);\n"
+		"}",
+		std::string(shader_header) + depth_fragment_source);
+	occlusion.init(occlusion_program);
+
+	auto& wheel_mesh = shapes.wheel(0.3f, 0.1f, 16);
+	InstanceBuffer wheel_instances;
+	wheel_instances.attach(wheel_mesh, ATTRIB_INSTANCE_MAT, ATTRIB_INSTANCE_PHASE);
+	std::vector<Instance> wheels;
+
+	// local bounds of a whole train, the wheel spins around its own axis so its box never changes
+	AABB train_bounds;
+	train_bounds.extend(shapes.prism(1.5f, 0.5f, 0.5f).bounds);
+	train_bounds.extend(shapes.prism(0.5f, 0.5f, 0.25f, 0.5f).bounds);
+	for (auto& pos : WHEEL_OFFSETS)
+		train_bounds.extend(wheel_mesh.bounds.transformed(wheel_transform(mat4(1.f), pos)));
+	Frustum frustum;
+
+	ring.init();
+	profiler.init();
+	queue.init();
+	prepass.init();
+	light_clusters.init(1.f, 1000.f);
+	// queue program slots per shading path, each linked to its depth-only program
+	struct Slots
+	{
+		uint8_t grid;
+		uint8_t object;
+		uint8_t crowd;
+		uint8_t wheel;
+	}slots[2];
+	for (auto deferred = 0; deferred < 2; deferred++)
+	{
+		slots[deferred].grid = queue.add_program(deferred ? grid_gbuffer_program : grid_program, grid_depth_program, "grid");
+		slots[deferred].object = queue.add_program(object_program[deferred], object_program[2], "train body");
+		slots[deferred].crowd = queue.add_program(crowd_program[deferred], crowd_program[2], "cows");
+		slots[deferred].wheel = queue.add_program(wheel_program[deferred], wheel_program[2], "wheels");
+	}
+
+	handoff.set_started(true);
+
+	FrameReport report;
+	while (auto snapshot = handoff.take())
+	{
+		auto& s = *snapshot;
+		if (bench.enabled)
+			bench.begin_frame();
+		TRACE_FRAME();
+		{
+			TRACE_ZONE("asset pump");
+			loader.pump();
+		}
+		ring.begin_frame();
+		profiler.begin_frame();
+		gl_state.begin_frame();
+
+		auto win_width = s.width;
+		auto win_height = s.height;
 		glViewport(0, 0, win_width, win_height);
 
-		glClearColor(0.7f, 0.7f, 0.7f, 1.f);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		// the deferred lighting pass covers the whole target, the g-buffer is cleared instead
+		auto deferred = s.controls.shading == Shading::Deferred;
+		prepass.mode = s.controls.prepass;
+		occlusion.enabled = s.controls.occlusion;
+		auto& slot = slots[deferred];
+		const vec4 clear_color(0.7f, 0.7f, 0.7f, 1.f);
+		if (!deferred)
+		{
+			gl_state.clear_color(clear_color);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		}
 
-		glEnable(GL_TEXTURE_2D);
-		glEnable(GL_DEPTH);
-		glEnable(GL_DEPTH_TEST);
-		glEnable(GL_CULL_FACE);
-		glEnable(GL_NORMALIZE);
+		gl_state.enable(GL_TEXTURE_2D);
+		gl_state.enable(GL_DEPTH_TEST);
+		gl_state.enable(GL_CULL_FACE);
+		gl_state.enable(GL_NORMALIZE);
 
 		auto proj = perspective(radians(45.f), (float)win_width / (float)win_height, 1.f, 1000.f);
-		glMatrixMode(GL_PROJECTION);
+		gl_state.matrix_mode(GL_PROJECTION);
 		glLoadMatrixf(&proj[0][0]);
-		glMatrixMode(GL_MODELVIEW);
-		auto view = camera.update();
+		gl_state.matrix_mode(GL_MODELVIEW);
+		auto& view = s.view;
+		auto alpha = s.alpha;
 		auto mv = view * mat4(1.f);
 		glLoadMatrixf(&mv[0][0]);
+		frustum.extract(proj * view);
 
-		glUseProgram(grid_program);
+		profiler.begin("build");
+		queue.begin(view);
+		occlusion.begin_frame(s.trains.size() + cows.instances.size());
+		queue.submit(slot.grid, 0, nullptr, vec3(0.f)).callback = draw_grid;
 
-		glBegin(GL_LINES);
-		auto offset = vec2(GRIDX, GRIDY) * GRIDS * -0.5f;
-		for (auto y = 0; y < GRIDY + 1; y++)
+		light_clusters.update(s.lights, proj, view, !deferred);
+		light_clusters.bind();
 		{
-			glColor3f(0.78f, 0.88f, 0.80f);
-			glVertex3f(0.f + offset.x, 0.f, y * GRIDS + offset.y);
-			glVertex3f(GRIDX * GRIDS + offset.x, 0.f, y * GRIDS + offset.y);
+			FrameUniforms frame;
+			frame.proj = proj;
+			frame.view = view;
+			frame.camera_coord = vec4(s.camera_coord, 1.f);
+			frame.cluster_params = light_clusters.params(win_width, win_height);
+			frame.inv_view_proj = inverse(proj * view);
+			queue.set_frame(frame);
 		}
-		for (auto x = 0; x < GRIDX + 1; x++)
+
+		auto& body_front = shapes.prism(1.5f, 0.5f, 0.5f);
+		auto& body_top = shapes.prism(0.5f, 0.5f, 0.25f, 0.5f);
+		// culling, sort keys and matrices per train chunk on the frame pool, merged in chunk order
+		pool.run(pool.size(), [&](int c) {
+			auto& list = draw_lists[c];
+			auto& chunk_wheels = wheel_lists[c];
+			chunk_wheels.clear();
+			auto r = FramePool::range(s.trains.size(), c, pool.size());
+			for (auto i = r.first; i < r.second; i++)
+			{
+				auto& train = s.trains[i];
+				auto train_transform = train.transform(alpha);
+				auto box = train_bounds.transformed(train_transform);
+				if (!frustum.visible(box) || !occlusion.visible((uint32_t)i, box, s.camera_coord))
+					continue;
+				auto nor = transpose(inverse(mat3(train_transform)));
+				for (auto mesh : { &body_front, &body_top })
+				{
+					auto& p = queue.submit(list, slot.object, body_texture, mesh, box.center());
+					p.model = train_transform;
+					p.normal = nor;
+				}
+				append_wheels(chunk_wheels, train_transform, train.move != 0 ? radians(train.angle(alpha)) : 0.f);
+			}
+		});
+		wheels.clear();
+		for (auto c = 0; c < pool.size(); c++)
 		{
-			if (x == 8 || x == 9)
-				glColor3f(0.f, 0.f, 0.f);
-			else
-				glColor3f(0.78f, 0.88f, 0.80f);
-			glVertex3f(x * GRIDS + offset.x, 0.f, 0.f + offset.y);
-			glVertex3f(x * GRIDS + offset.x, 0.f, GRIDY * GRIDS + offset.y);
+			queue.merge(draw_lists[c]);
+			wheels.insert(wheels.end(), wheel_lists[c].begin(), wheel_lists[c].end());
 		}
-		glEnd();
+		wheel_instances.stream(ring, wheels);
+		if (wheel_instances.count)
+			queue.submit(slot.wheel, wheel_texture, &wheel_mesh, s.camera_coord).instance_count = wheel_instances.count;
+
+		// cows outside the frustum or occluded are left out of the buffer
+		cows.update();
+		cows.cull([&](size_t i, const AABB& box) {
+			return frustum.visible(box) && occlusion.visible((uint32_t)(s.trains.size() + i), box, s.camera_coord);
+		});
+		if (cows.attached_vao && cows.buffer.count && frustum.visible(cows.bounds))
+			queue.submit(slot.crowd, cow.texture, &cow.mesh, cows.bounds.center()).instance_count = cows.buffer.count;
 
-		if (move == 1)
+		profiler.end();
+
+		if (deferred)
+			gbuffer.begin(win_width, win_height, clear_color);
+		if (prepass.begin_frame())
 		{
-			train_z -= speed;
-			if (train_z <= GRIDY * -0.5f * GRIDS + 1.5f)
-				move = 2;
+			ProfileScope scope("depth pre-pass");
+			gl_state.color_mask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+			queue.execute(true);
+			gl_state.color_mask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+			gl_state.depth_func(GL_EQUAL);
+			gl_state.depth_mask(GL_FALSE);
 		}
-		else if (move == 2)
 		{
-			train_z += speed;
-			if (train_z >= GRIDY * 0.5f * GRIDS)
-				move = 1;
+			ProfileScope scope("shading");
+			prepass.begin_shading();
+			queue.execute();
+			prepass.end_shading();
 		}
-
-		auto train_pos = vec3((GRIDX * -0.5f + 8.f) * GRIDS - 0.15f, 0.3f, train_z);
-
-		glUseProgram(object_program);
-		glUniformMatrix4fv(proj_mat_id, 1, false, &proj[0][0]);
-		glUniformMatrix4fv(view_mat_id, 1, false, &view[0][0]);
-		glUniform3fv(camera_coord_id, 1, &camera.coord[0]);
+		gl_state.depth_func(GL_LESS);
+		gl_state.depth_mask(GL_TRUE);
+		{
+			ProfileScope scope("occlusion");
+			occlusion.issue();
+		}
+		if (deferred)
 		{
-			auto p = train_pos + vec3(0.15, 0.55, -1.6);
-			glUniform3fv(light1_id, 1, &p[0]);
+			ProfileScope scope("lighting");
+			gbuffer.light(ambient_program, point_light_program, (GLsizei)s.lights.size(), bench.enabled ? bench.fbo : 0);
 		}
+
+		// the main thread built the UI, only its draw data comes along
+		if (s.ui.data.Valid)
 		{
-			auto p = train_pos + vec3(0.35, 0.55, -1.6);
-			glUniform3fv(light2_id, 1, &p[0]);
+			ProfileScope scope("UI");
+			ImGui_ImplOpenGL2_RenderDrawData(&s.ui.data);
 		}
 
-		auto train_transform = translate(mat4(1.f), train_pos);
+		profiler.end_frame();
+		ring.end_frame();
+		TRACE_COUNTER("draws", queue.stats.draws);
+		TRACE_COUNTER("lights", s.lights.size());
+		TRACE_COUNTER("occluded", occlusion.stats.occluded);
+		TRACE_COUNTER("ring bytes", ring.stats.bytes);
+		TRACE_COUNTER("pending assets", loader.pending.load());
+		TRACE_COUNTER("gl state issued", gl_state.stats.issued);
+		TRACE_COUNTER("gl state redundant", gl_state.stats.redundant);
 		{
-			glUniformMatrix4fv(model_mat_id, 1, false, &train_transform[0][0]);
-			auto nor = transpose(inverse(mat3(train_transform)));
-			glUniformMatrix3fv(normal_mat_id, 1, false, &nor[0][0]);
+			TRACE_ZONE("present");
+			if (bench.enabled)
+				bench.end_frame();
+			else
+				glfwSwapBuffers(window);
 		}
-		glBindTexture(GL_TEXTURE_2D, body_texture);
-		glBegin(GL_TRIANGLES);
-		prism(1.5f, 0.5f, 0.5f);
-		prism(0.5f, 0.5f, 0.25f, 0.5f);
-		glEnd();
 
-		glBindTexture(GL_TEXTURE_2D, wheel_texture);
-		auto draw_wheel = [&](const vec3& pos) {
-			auto wheel_transform = train_transform * translate(mat4(1.f), pos) * rotate(mat4(1.f), radians(90.f), vec3(0.f, 1.f, 0.f));
-			if (move != 0)
+		report.profiler = profiler.summary;
+		report.deferred = deferred;
+		report.prepass = prepass.name();
+		report.prepass_active = prepass.active;
+		report.overdraw = prepass.overdraw();
+		report.queue = queue.stats;
+		report.occlusion = occlusion.stats;
+		report.ring = ring.stats;
+		report.lights = s.lights.size();
+		report.gl = gl_state.stats;
+		handoff.finish(report);
+	}
+
+	if (bench.enabled)
+		bench.report();
+	loader.stop();
+	pool.stop();
+	wheel_instances.destroy();
+	cows.destroy();
+	ring.destroy();
+	light_clusters.destroy();
+	gbuffer.destroy();
+	prepass.destroy();
+	occlusion.destroy();
+	profiler.destroy();
+	shapes.clear();
+	if (bench.enabled)
+		bench.destroy();
+	set_context_current(false);
+}
+
+int main(int argc, char** argv)
+{
+	bench.parse(argc, argv);
+	scene.parse(argc, argv);
+	scene.generate();
+	prepass.parse(argc, argv);
+	occlusion.parse(argc, argv);
+	tracer.parse(argc, argv);
+	redraw.parse(argc, argv);
+	tracer.name_thread("main");
+	controls.prepass = prepass.mode;
+	controls.occlusion = occlusion.enabled;
+	for (auto i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--compact"))
+			compact_vertices = true;
+		else if (!strcmp(argv[i], "--deferred"))
+			controls.shading = Shading::Deferred;
+	}
+	if (bench.enabled)
+	{
+		if (!bench.create_context())
+			return 1;
+	}
+	else
+	{
+		if (!glfwInit())
+			return 0;
+
+		window = glfwCreateWindow(800, 600, "", nullptr, nullptr);
+		if (!window)
+			return 0;
+
+		glfwMakeContextCurrent(window);
+		glfwSwapInterval(1);
+	}
+
+	IMGUI_CHECKVERSION();
+	ImGui::CreateContext();
+
+	ImGui::StyleColorsDark();
+
+	// no UI without a window (bench)
+	if (!bench.enabled)
+	{
+		ImGui_ImplGlfw_InitForOpenGL(window, true);
+
+		prev_keyfun = glfwSetKeyCallback(window, key_callback);
+		prev_mousebuttonfun = glfwSetMouseButtonCallback(window, mouse_button_callback);
+		prev_cursorposfun = glfwSetCursorPosCallback(window, cursor_position_callback);
+	}
+
+	// GLFW, input, simulation and the UI stay on this thread, GL moves to the render thread
+	set_context_current(false);
+	FrameHandoff handoff;
+	std::thread render_thread(render_main, std::ref(handoff));
+
+	if (handoff.wait_started())
+	{
+		// the bench train starts right away
+		if (bench.enabled)
+			move = 1;
+		FrameReport report;
+		while (bench.enabled ? bench.running() : !glfwWindowShouldClose(window))
+		{
+			if (bench.enabled)
+				bench.script_camera(camera, (int)handoff.published);
+			else
 			{
-				static auto ang = 0.f;
-				wheel_transform = wheel_transform * rotate(mat4(1.f), radians(ang), vec3(0.f, 0.f, 1.f));
-				ang += move == 1 ? -12.f : 12.f;
+				TRACE_ZONE("poll events");
+				// paced by the renderer: while the last snapshot is still pending only events wake us
+				if (!handoff.wait_taken(sim_clock.step))
+					glfwPollEvents();
 			}
+			// nothing changed since the last frames settled: keep the presented frame and sleep
+			if (!bench.enabled && !redraw.needed(scene.animating() || camera.moving()))
 			{
-				auto m = wheel_transform * rotate(mat4(1.f), radians(180.f), vec3(0.f, 1.f, 0.f));
-				glUniformMatrix4fv(model_mat_id, 1, false, &m[0][0]);
-				auto nor = transpose(inverse(mat3(m)));
-				glUniformMatrix3fv(normal_mat_id, 1, false, &nor[0][0]);
+				redraw.wait();
+				sim_clock.reset();
+				continue;
 			}
-			gluDisk(quadrics, 0.f, 0.3f, 16, 16);
+
+			auto& s = handoff.next();
+			// the bench advances exactly one step per frame so runs are deterministic
+			auto frame_dt = bench.enabled ? sim_clock.step : sim_clock.frame_time();
 			{
-				auto m = wheel_transform * translate(mat4(1.f), vec3(0.f, 0.f, 0.1f));
-				glUniformMatrix4fv(model_mat_id, 1, false, &m[0][0]);
-				auto nor = transpose(inverse(mat3(m)));
-				glUniformMatrix3fv(normal_mat_id, 1, false, &nor[0][0]);
+				TRACE_ZONE("simulation");
+				for (auto n = sim_clock.advance(frame_dt); n > 0; n--)
+					scene.step((float)sim_clock.step);
 			}
-			gluDisk(quadrics, 0.f, 0.3f, 16, 16);
+			s.view = camera.update((float)frame_dt);
+			s.camera_coord = camera.coord;
+			s.alpha = sim_clock.alpha;
+			s.trains = scene.trains;
+			scene.lights(s.lights, s.alpha);
+			s.controls = controls;
+			s.width = bench.width;
+			s.height = bench.height;
+			if (!bench.enabled)
 			{
-				glUniformMatrix4fv(model_mat_id, 1, false, &wheel_transform[0][0]);
-				auto nor = transpose(inverse(mat3(wheel_transform)));
-				glUniformMatrix3fv(normal_mat_id, 1, false, &nor[0][0]);
-			}
-			gluCylinder(quadrics, 0.3f, 0.3f, 0.1f, 16, 16);
-		};
-		draw_wheel(vec3(-0.1f, 0.f, 0.f));
-		draw_wheel(vec3(-0.1f, 0.f, -0.6f));
-		draw_wheel(vec3(-0.1f, 0.f, -1.2f));
-		draw_wheel(vec3(0.5f, 0.f, 0.f));
-		draw_wheel(vec3(0.5f, 0.f, -0.6f));
-		draw_wheel(vec3(0.5f, 0.f, -1.2f));
+				glfwGetWindowSize(window, &s.width, &s.height);
 
-		{
-			auto m = scale(mat4(1.f), vec3(0.1f));
-			m = rotate(m, radians(-90.f), vec3(1.f, 0.f, 0.f));
-			m = translate(m, vec3((GRIDX * -0.5f + 8.f) * GRIDS, 0.f, (GRIDY * 0.5f) * GRIDS));
-			glUniformMatrix4fv(model_mat_id, 1, false, &m[0][0]);
-			auto nor = transpose(inverse(mat3(m)));
-			glUniformMatrix3fv(normal_mat_id, 1, false, &nor[0][0]);
+				TRACE_ZONE("UI");
+				ImGui_ImplGlfw_NewFrame();
+				ImGui::NewFrame();
+				handoff.latest_report(report);
+				draw_overlay(report);
+				ImGui::Render();
+				s.ui.capture(ImGui::GetDrawData());
+			}
+			handoff.publish();
+			// lockstep, the bench times every frame it simulates
+			if (bench.enabled)
+				handoff.wait_rendered();
 		}
-		cow.draw();
-
-		//ImGui::Render();
-		//ImGui_ImplOpenGL2_RenderDrawData(ImGui::GetDrawData());
-
-		glfwSwapBuffers(window);
 	}
 
+	handoff.stop();
+	render_thread.join();
+	if (tracer.dump_on_exit && tracer.enabled)
+		tracer.stop(tracer.path);
 	glfwTerminate();
 	return 0;
 }